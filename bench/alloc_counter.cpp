@@ -0,0 +1,114 @@
+#include "alloc_counter.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+//All the new overloads end up in operator new(size_t) and all the delete overloads in operator delete(void*), so every
+//one of them is replaced and they always pair up. They live in their own file so the compiler can't inline them into
+//callers and see malloc paired with delete.
+static std::atomic<uint64_t> g_allocations{0};
+
+void* operator new(size_t size) {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = std::malloc(size ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	try {
+		return operator new(size);
+	}
+	catch (...) {
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return operator new(size, std::nothrow);
+}
+
+//Over-allocates and keeps the pointer operator new returned just below the aligned block.
+void* operator new(size_t size, std::align_val_t align) {
+	size_t alignment = std::max((size_t)align, sizeof(void*));
+	char* raw = (char*)operator new(size + alignment + sizeof(void*));
+	char* p = (char*)(((uintptr_t)raw + sizeof(void*) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	((void**)p)[-1] = raw;
+	return p;
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+	return operator new(size, align);
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+	try {
+		return operator new(size, align);
+	}
+	catch (...) {
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+	return operator new(size, align, std::nothrow);
+}
+
+void operator delete[](void* p) noexcept {
+	operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+	operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+	operator delete(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+	if (p != nullptr)
+		operator delete(((void**)p)[-1]);
+}
+
+void operator delete[](void* p, std::align_val_t align) noexcept {
+	operator delete(p, align);
+}
+
+void operator delete(void* p, size_t, std::align_val_t align) noexcept {
+	operator delete(p, align);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t align) noexcept {
+	operator delete(p, align);
+}
+
+void operator delete(void* p, std::align_val_t align, const std::nothrow_t&) noexcept {
+	operator delete(p, align);
+}
+
+void operator delete[](void* p, std::align_val_t align, const std::nothrow_t&) noexcept {
+	operator delete(p, align);
+}
+
+uint64_t GetAllocationCount() {
+	return g_allocations.load(std::memory_order_relaxed);
+}
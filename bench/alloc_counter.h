@@ -0,0 +1,8 @@
+#pragma once
+#include <cstdint>
+
+//Replaces the global operator new and delete for the bench, counting every C++ allocation so the hot loop can prove it
+//doesn't allocate.
+
+//Allocations made so far, by any thread.
+uint64_t GetAllocationCount();
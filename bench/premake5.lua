@@ -0,0 +1,39 @@
+--Standalone replay benchmark for the voice pipeline. Builds the voice code against a stubbed CRC, no GMod SDK or
+--garrysmod_common needed: premake5 --file=bench/premake5.lua <action>
+workspace("eightbit_bench")
+	configurations({"Release", "Debug"})
+	platforms({"x86_64", "x86"})
+	location("../projects/bench/" .. os.target() .. "/" .. (_ACTION or ""))
+
+	filter({"platforms:x86_64"})
+		architecture("x86_64")
+
+	filter({"platforms:x86"})
+		architecture("x86")
+
+	filter({"configurations:Release"})
+		optimize("Speed")
+		symbols("On")
+
+	filter({"configurations:Debug"})
+		symbols("On")
+
+	filter({})
+
+	project("eightbit_bench")
+		kind("ConsoleApp")
+		language("C++")
+		cppdialect("C++17")
+		files({"*.cpp", "stub/*.h", "../source/mapped_file.cpp"})
+		includedirs({"stub", "../source", "../opus/include"})
+		links("opus")
+
+		--opus/lib64 only has the Windows library, 64 bit Linux builds link the system libopus.
+		filter({"platforms:x86_64", "system:windows"})
+			libdirs {"../opus/lib64"}
+
+		filter({"platforms:x86"})
+			libdirs {"../opus/lib32"}
+
+		filter("system:linux")
+			links("pthread")
@@ -0,0 +1,474 @@
+//Standalone replay benchmark for the voice pipeline.
+//Builds the module's decode -> effects -> encode path against a stubbed CRC, no GMod SDK or srcds required.
+//
+//Usage: eightbit_bench [corpus file] [passes]
+//Without a corpus file a synthetic one is generated. Corpus files are the ones written by eightbit.StartCapture.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "ivoicecodec.h"
+#include "opus_framedecoder.h"
+#include "audio_effects.h"
+#include "steam_voice.h"
+#include "voice_corpus.h"
+#include "mapped_file.h"
+#include "relay_protocol.h"
+#include "voice_inject.h"
+#include "alloc_counter.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static uint64_t ElapsedNs(bench_clock::time_point a, bench_clock::time_point b) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(b - a).count();
+}
+
+#define MAX_SLOTS 256
+#define SYNTH_SPEAKERS 8
+#define SYNTH_SECONDS 20
+#define SYNTH_FRAMES_PER_PACKET 2
+
+//Speech-ish test signal: a few harmonics of a wobbling pitch, some noise, and talk bursts with pauses.
+static void SynthesizeSpeech(int speaker, int64_t sampleOffset, int16_t* out, int samples) {
+	const float rate = (float)SAMPLERATE_GMOD_OPUS;
+	const float f0 = 110.0f + speaker * 17.0f;
+	uint32_t noise = 0x9E3779B9u * (uint32_t)(speaker + 1) + (uint32_t)sampleOffset;
+
+	for (int i = 0; i < samples; i++) {
+		float t = (sampleOffset + i) / rate;
+		float pitch = f0 * (1.0f + 0.05f * std::sin(t * 3.0f));
+		float env = std::sin(t * 1.3f + speaker) > -0.3f ? 1.0f : 0.0f;
+		float v = 0.0f;
+		for (int h = 1; h <= 5; h++)
+			v += std::sin(2.0f * 3.14159265f * pitch * h * t) / h;
+
+		noise = noise * 1664525u + 1013904223u;
+		v += ((noise >> 16) / 65536.0f - 0.5f) * 0.1f;
+		out[i] = (int16_t)(v * env * 6000.0f);
+	}
+}
+
+//Builds an in-memory corpus of SYNTH_SPEAKERS interleaved speakers, encoded exactly like the module re-encodes.
+static std::vector<char> BuildSyntheticCorpus() {
+	const int samplesPerPacket = FRAME_SIZE_GMOD * SYNTH_FRAMES_PER_PACKET;
+	const int packetsPerSpeaker = SYNTH_SECONDS * SAMPLERATE_GMOD_OPUS / samplesPerPacket;
+	const uint64_t records = (uint64_t)packetsPerSpeaker * SYNTH_SPEAKERS;
+	const uint64_t fileSize = VoiceCorpus::DataOffset(records) + records * VoiceCorpus::RecordSize(2048);
+
+	std::vector<char> corpus(fileSize);
+	VoiceCorpus::InitHeader(corpus.data(), fileSize, records);
+
+	std::vector<SteamOpus::Opus_FrameDecoder*> encoders;
+	for (int s = 0; s < SYNTH_SPEAKERS; s++)
+		encoders.push_back(new SteamOpus::Opus_FrameDecoder());
+
+	std::vector<int16_t> pcm(samplesPerPacket);
+	std::vector<char> packet(4096);
+
+	for (int p = 0; p < packetsPerSpeaker; p++) {
+		for (int s = 0; s < SYNTH_SPEAKERS; s++) {
+			SynthesizeSpeech(s, (int64_t)p * samplesPerPacket, pcm.data(), samplesPerPacket);
+
+			uint64_t steamid = 76561197960265728ull + s;
+			int len = SteamVoice::CompressIntoBuffer(steamid, encoders[s], (const char*)pcm.data(), samplesPerPacket * 2, packet.data(), (int)packet.size(), 24000);
+			if (len <= 0)
+				continue;
+
+			uint64_t ts = (uint64_t)p * samplesPerPacket * 1000000000ull / SAMPLERATE_GMOD_OPUS;
+			VoiceCorpus::Append(corpus.data(), ts, steamid, s, packet.data(), len);
+		}
+	}
+
+	for (auto enc : encoders)
+		delete enc;
+
+	return corpus;
+}
+
+struct BenchEffect {
+	int id;
+	float args[MAX_EFFECT_ARGS];
+	int nargs;
+};
+
+struct BenchConfig {
+	const char* name;
+	std::vector<BenchEffect> effects;
+};
+
+static std::vector<BenchConfig> GetConfigs() {
+	using namespace AudioEffects;
+	return {
+		{"none (decode+encode)", {}},
+		{"bitcrush", {{EFF_BITCRUSH, {350, 1.2f}, 2}}},
+		{"desample", {{EFF_DESAMPLE, {2}, 1}}},
+		{"lpf", {{EFF_LPF, {0.3f}, 1}}},
+		{"hpf", {{EFF_HPF, {0.8f}, 1}}},
+		{"normalize", {{EFF_NORMALIZE, {0.9f}, 1}}},
+		{"compressor", {{EFF_COMPRESSOR, {8000, 4}, 2}}},
+		{"delay", {{EFF_DELAY, {4800, 128}, 2}}},
+		{"distortion", {{EFF_DISTORTION, {6000}, 1}}},
+		{"waveshaper", {{EFF_WAVESHAPER, {0.7f}, 1}}},
+		{"reverb", {{EFF_REVERB, {200, 180, 100}, 3}}},
+		{"chain: 8bit (bitcrush+desample)", {{EFF_BITCRUSH, {350, 1.2f}, 2}, {EFF_DESAMPLE, {2}, 1}}},
+		{"chain: radio (hpf+compressor+normalize)", {{EFF_HPF, {0.8f}, 1}, {EFF_COMPRESSOR, {8000, 4}, 2}, {EFF_NORMALIZE, {0.9f}, 1}}},
+		{"chain: room (reverb+delay)", {{EFF_REVERB, {200, 180, 100}, 3}, {EFF_DELAY, {4800, 128}, 2}}},
+	};
+}
+
+static uint64_t Percentile(std::vector<uint32_t>& sorted, double p) {
+	if (sorted.empty())
+		return 0;
+
+	size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[idx];
+}
+
+static double Mean(const std::vector<uint32_t>& v) {
+	if (v.empty())
+		return 0.0;
+
+	double sum = 0.0;
+	for (uint32_t x : v)
+		sum += x;
+	return sum / v.size();
+}
+
+//Returns false if the timed loop allocated.
+static bool RunConfig(const BenchConfig& config, const VoiceCorpus::View& corpus, int passes) {
+	AudioEffects::EffectChain chain;
+	for (const BenchEffect& eff : config.effects)
+		AudioEffects::AddEffect(chain, eff.id, eff.args, eff.nargs);
+
+	static char decompressBuf[20 * 1024];
+	static char recompressBuf[4096];
+
+	//Same per-player setup the module does at EnableEffect time, done before the clock starts. Each player's first
+	//packet goes through untimed too, so codec state created on first use isn't counted against the hot path.
+	std::vector<IVoiceCodec*> codecs(MAX_SLOTS, nullptr);
+	std::vector<AudioEffects::EffectState*> states(MAX_SLOTS, nullptr);
+	for (uint64_t i = 0; i < corpus.Count(); i++) {
+		const VoiceCorpus::RecordHeader* rec = corpus.Record(i);
+		uint32_t slot = rec->slot % MAX_SLOTS;
+		if (codecs[slot] != nullptr)
+			continue;
+
+		codecs[slot] = new SteamOpus::Opus_FrameDecoder();
+		states[slot] = new AudioEffects::EffectState();
+
+		int bytesDecompressed = SteamVoice::DecompressIntoBuffer(codecs[slot], corpus.Payload(i), rec->length, decompressBuf, sizeof(decompressBuf));
+		if (bytesDecompressed > 0) {
+			int samples = bytesDecompressed / 2;
+			chain.Run((uint16_t*)decompressBuf, samples, states[slot]);
+			SteamVoice::CompressIntoBuffer(*(uint64_t*)corpus.Payload(i), codecs[slot], decompressBuf, samples * 2, recompressBuf, sizeof(recompressBuf), 24000);
+		}
+	}
+
+	const size_t total = (size_t)corpus.Count() * passes;
+	std::vector<uint32_t> decodeNs, effectsNs, encodeNs, packetNs;
+	decodeNs.reserve(total);
+	effectsNs.reserve(total);
+	encodeNs.reserve(total);
+	packetNs.reserve(total);
+	uint64_t failures = 0;
+
+	uint64_t allocsBefore = GetAllocationCount();
+	bench_clock::time_point start = bench_clock::now();
+
+	for (int pass = 0; pass < passes; pass++) {
+		for (uint64_t i = 0; i < corpus.Count(); i++) {
+			const VoiceCorpus::RecordHeader* rec = corpus.Record(i);
+			const char* data = corpus.Payload(i);
+			uint32_t slot = rec->slot % MAX_SLOTS;
+			IVoiceCodec* codec = codecs[slot];
+
+			bench_clock::time_point t0 = bench_clock::now();
+			int bytesDecompressed = SteamVoice::DecompressIntoBuffer(codec, data, rec->length, decompressBuf, sizeof(decompressBuf));
+			bench_clock::time_point t1 = bench_clock::now();
+			if (bytesDecompressed <= 0) {
+				failures++;
+				continue;
+			}
+
+			int samples = bytesDecompressed / 2;
+			chain.Run((uint16_t*)decompressBuf, samples, states[slot]);
+			bench_clock::time_point t2 = bench_clock::now();
+
+			int bytesWritten = SteamVoice::CompressIntoBuffer(*(uint64_t*)data, codec, decompressBuf, samples * 2, recompressBuf, sizeof(recompressBuf), 24000);
+			bench_clock::time_point t3 = bench_clock::now();
+			if (bytesWritten <= 0)
+				failures++;
+
+			decodeNs.push_back((uint32_t)ElapsedNs(t0, t1));
+			effectsNs.push_back((uint32_t)ElapsedNs(t1, t2));
+			encodeNs.push_back((uint32_t)ElapsedNs(t2, t3));
+			packetNs.push_back((uint32_t)ElapsedNs(t0, t3));
+		}
+	}
+
+	uint64_t wallNs = ElapsedNs(start, bench_clock::now());
+	uint64_t allocs = GetAllocationCount() - allocsBefore;
+
+	for (size_t i = 0; i < codecs.size(); i++) {
+		delete codecs[i];
+		delete states[i];
+	}
+
+	std::sort(effectsNs.begin(), effectsNs.end());
+	std::sort(packetNs.begin(), packetNs.end());
+
+	size_t processed = packetNs.size();
+	std::printf("%-40s %10.0f %8.0f %8.0f %8.0f   %7llu %7llu %7llu   %7llu %7llu %7llu   %6.3f %6llu\n",
+		config.name,
+		wallNs ? processed * 1e9 / wallNs : 0.0,
+		Mean(decodeNs), Mean(effectsNs), Mean(encodeNs),
+		(unsigned long long)Percentile(effectsNs, 0.50), (unsigned long long)Percentile(effectsNs, 0.99), (unsigned long long)Percentile(effectsNs, 0.999),
+		(unsigned long long)Percentile(packetNs, 0.50), (unsigned long long)Percentile(packetNs, 0.99), (unsigned long long)Percentile(packetNs, 0.999),
+		processed ? (double)allocs / processed : 0.0,
+		(unsigned long long)failures);
+
+	if (allocs != 0) {
+		std::fprintf(stderr, "%s: %llu heap allocations while processing packets\n", config.name, (unsigned long long)allocs);
+		return false;
+	}
+
+	return true;
+}
+
+//Frames the corpus the way the relay does (packets grouped per 15ms server frame, datagrams kept under 1200 bytes),
+//decodes every datagram with the reference Reader and checks each packet comes back unchanged.
+static bool CheckRelayRoundTrip(const VoiceCorpus::View& corpus) {
+	const uint64_t frameNs = 15000000;
+	const size_t mtu = 1200;
+
+	std::vector<std::vector<char>> datagrams;
+	std::vector<char> buf(4096);
+	std::vector<uint32_t> slotSeq(256);
+	RelayProtocol::Writer writer;
+	uint64_t frame = 0;
+
+	auto finish = [&]() {
+		if (writer.IsOpen()) {
+			size_t len = writer.Finish();
+			datagrams.emplace_back(buf.begin(), buf.begin() + len);
+		}
+	};
+
+	for (uint64_t i = 0; i < corpus.Count(); i++) {
+		const VoiceCorpus::RecordHeader* rec = corpus.Record(i);
+		if (rec->length <= sizeof(uint64_t))
+			continue;
+
+		RelayProtocol::PacketInfo info;
+		info.timestampNs = rec->timestampNs;
+		info.steamid = rec->steamid;
+		info.sequence = slotSeq[rec->slot & 255]++;
+		info.slot = (uint16_t)rec->slot;
+		info.flags = (uint8_t)(i & RelayProtocol::FLAG_EFFECTS);
+		info.length = (uint16_t)(rec->length - sizeof(uint64_t));
+
+		if (writer.IsOpen() && (rec->timestampNs / frameNs != frame || !writer.Fits(info.length) || writer.Size() + RelayProtocol::PACKET_HEADER_SIZE + info.length > mtu))
+			finish();
+
+		if (!writer.IsOpen()) {
+			writer.Begin(buf.data(), buf.size(), (uint32_t)datagrams.size());
+			frame = rec->timestampNs / frameNs;
+		}
+
+		writer.Append(info, corpus.Payload(i) + sizeof(uint64_t));
+	}
+	finish();
+
+	std::fill(slotSeq.begin(), slotSeq.end(), 0);
+	uint64_t next = 0;
+	for (size_t d = 0; d < datagrams.size(); d++) {
+		RelayProtocol::Reader reader(datagrams[d].data(), datagrams[d].size());
+		if (!reader.IsValid() || reader.Sequence() != d)
+			return false;
+
+		RelayProtocol::PacketInfo info;
+		const char* payload;
+		while (reader.Next(info, payload)) {
+			while (next < corpus.Count() && corpus.Record(next)->length <= sizeof(uint64_t))
+				next++;
+			if (next == corpus.Count())
+				return false;
+
+			const VoiceCorpus::RecordHeader* rec = corpus.Record(next);
+			if (info.timestampNs != rec->timestampNs || info.steamid != rec->steamid || info.slot != rec->slot ||
+				info.sequence != slotSeq[rec->slot & 255]++ || info.flags != (next & RelayProtocol::FLAG_EFFECTS) ||
+				info.length != rec->length - sizeof(uint64_t) ||
+				std::memcmp(payload, corpus.Payload(next) + sizeof(uint64_t), info.length) != 0)
+				return false;
+
+			next++;
+		}
+	}
+
+	//Any packet left over never made it into a datagram.
+	while (next < corpus.Count() && corpus.Record(next)->length <= sizeof(uint64_t))
+		next++;
+	if (next != corpus.Count())
+		return false;
+
+	std::printf("relay framing: %llu packets in %llu datagrams, round trip ok\n\n", (unsigned long long)corpus.Count(), (unsigned long long)datagrams.size());
+	return true;
+}
+
+static InjectPacket MakeInjectPacket(uint32_t sequence, uint64_t timestampNs, uint64_t arrivalNs) {
+	InjectPacket pkt;
+	pkt.arrivalNs = arrivalNs;
+	pkt.timestampNs = timestampNs;
+	pkt.steamid = 0;
+	pkt.sequence = sequence;
+	pkt.length = 1;
+	pkt.generation = 0;
+	pkt.data[0] = (char)sequence;
+	return pkt;
+}
+
+//Feeds packets to a jitter buffer in arrival order, playing out whatever is due before each arrival, then drains it.
+//Returns the sequence numbers in the order they were played.
+static std::vector<uint32_t> RunJitter(JitterBuffer& jitter, std::vector<InjectPacket>& pkts) {
+	std::stable_sort(pkts.begin(), pkts.end(), [](const InjectPacket& a, const InjectPacket& b) {
+		return a.arrivalNs < b.arrivalNs;
+	});
+
+	std::vector<uint32_t> played;
+	auto playDue = [&](uint64_t nowNs) {
+		while (const InjectPacket* pkt = jitter.PeekDue(nowNs)) {
+			played.push_back(pkt->sequence);
+			jitter.played++;
+			jitter.PopFront();
+		}
+	};
+
+	for (const InjectPacket& pkt : pkts) {
+		playDue(pkt.arrivalNs);
+		jitter.Insert(pkt);
+	}
+	playDue(pkts.back().arrivalNs + INJECT_MAX_DELAY_NS * 2);
+	return played;
+}
+
+//Runs the inject jitter buffer through reordering, late packets and overflow and checks what it plays out.
+static bool CheckJitterBuffer() {
+	const uint64_t ms = 1000000;
+	std::unique_ptr<JitterBuffer> jitter(new JitterBuffer());
+	std::vector<InjectPacket> pkts;
+
+	//Reordering: 20 ms packets with up to 10 ms of jitter. Past the first 40, every even packet arrives just after the
+	//odd one behind it. The delay has adapted to the jitter by then, every packet has to be played, in order.
+	const uint32_t count = 200;
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t ts = i * 20 * ms;
+		pkts.push_back(MakeInjectPacket(i, ts, ts + 5 * ms + (i * 7919 % 11) * ms));
+	}
+	for (uint32_t i = 40; i + 1 < count; i += 2)
+		pkts[i].arrivalNs = pkts[i + 1].arrivalNs + ms;
+
+	std::vector<uint32_t> played = RunJitter(*jitter, pkts);
+	for (size_t i = 1; i < played.size(); i++) {
+		if (played[i] <= played[i - 1])
+			return false;
+	}
+	if (played.size() != count || jitter->late != 0 || jitter->overflow != 0)
+		return false;
+
+	//Late: a packet whose turn has passed is counted and dropped, a duplicate of a buffered one is ignored.
+	jitter->Reset();
+	jitter->late = 0;
+	pkts.clear();
+	for (uint32_t i = 0; i < 10; i++)
+		pkts.push_back(MakeInjectPacket(i, i * 20 * ms, i * 20 * ms + 5 * ms));
+	played = RunJitter(*jitter, pkts);
+	uint64_t end = pkts.back().arrivalNs + 100 * ms;
+	jitter->Insert(MakeInjectPacket(3, 3 * 20 * ms, end));
+	jitter->Insert(MakeInjectPacket(10, 10 * 20 * ms, end));
+	jitter->Insert(MakeInjectPacket(10, 10 * 20 * ms, end));
+	if (played.size() != 10 || jitter->late != 1 || jitter->PeekDue(end + INJECT_MAX_DELAY_NS) == nullptr)
+		return false;
+	jitter->PopFront();
+	if (jitter->PeekDue(end + INJECT_MAX_DELAY_NS) != nullptr)
+		return false;
+
+	//Overflow: more packets than the buffer holds arrive before the first is due, 1 ms apart. The oldest make room and
+	//what's left plays in order.
+	const uint32_t extra = 4;
+	jitter->Reset();
+	jitter->late = 0;
+	pkts.clear();
+	for (uint32_t i = 0; i < INJECT_JITTER_DEPTH + extra; i++)
+		pkts.push_back(MakeInjectPacket(i, i * ms, i * ms + 5 * ms));
+	played = RunJitter(*jitter, pkts);
+	if (jitter->overflow != extra || jitter->late != 0 || played.size() != INJECT_JITTER_DEPTH)
+		return false;
+	for (uint32_t i = 0; i < INJECT_JITTER_DEPTH; i++) {
+		if (played[i] != extra + i)
+			return false;
+	}
+
+	std::printf("jitter buffer: reordering, late packets and overflow ok\n\n");
+	return true;
+}
+
+int main(int argc, char** argv) {
+	std::vector<char> synthetic;
+	MappedFile mapped;
+	int passes = argc > 2 ? std::atoi(argv[2]) : 3;
+	if (passes < 1)
+		passes = 1;
+
+	//Captured corpora are used straight from the mapping.
+	VoiceCorpus::View corpus;
+	if (argc > 1) {
+		if (!mapped.Open(argv[1])) {
+			std::fprintf(stderr, "couldn't map corpus %s\n", argv[1]);
+			return 1;
+		}
+		corpus = VoiceCorpus::View(mapped.Data(), mapped.Size());
+	}
+	else {
+		synthetic = BuildSyntheticCorpus();
+		corpus = VoiceCorpus::View(synthetic.data(), synthetic.size());
+	}
+
+	if (!corpus.IsValid() || corpus.Count() == 0) {
+		std::fprintf(stderr, "corpus is empty or invalid\n");
+		return 1;
+	}
+
+	std::printf("%llu packets (%s), %d passes\n\n", (unsigned long long)corpus.Count(), argc > 1 ? argv[1] : "synthetic", passes);
+
+	if (!CheckRelayRoundTrip(corpus)) {
+		std::fprintf(stderr, "relay framing round trip failed\n");
+		return 1;
+	}
+
+	if (!CheckJitterBuffer()) {
+		std::fprintf(stderr, "jitter buffer check failed\n");
+		return 1;
+	}
+	std::printf("%-40s %10s %8s %8s %8s   %7s %7s %7s   %7s %7s %7s   %6s %6s\n",
+		"config", "pkt/s", "dec ns", "eff ns", "enc ns",
+		"eff p50", "p99", "p999",
+		"pkt p50", "p99", "p999",
+		"alloc", "fail");
+
+	bool allocationFree = true;
+	for (const BenchConfig& config : GetConfigs())
+		allocationFree &= RunConfig(config, corpus, passes);
+
+	if (!allocationFree) {
+		std::fprintf(stderr, "the voice path allocated after warm-up\n");
+		return 1;
+	}
+
+	return 0;
+}
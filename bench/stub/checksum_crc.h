@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+
+//Stand-in for the Source SDK's checksum_crc.h so the voice code can be built without the SDK.
+//Same CRC-32 (IEEE 802.3, reflected) the engine uses for voice packets.
+typedef uint32_t CRC32_t;
+
+inline CRC32_t CRC32_ProcessSingleBuffer(const void* p, int len) {
+	static uint32_t table[256];
+	static bool tableInit = false;
+
+	if (!tableInit) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		tableInit = true;
+	}
+
+	uint32_t crc = 0xFFFFFFFFu;
+	const uint8_t* buf = (const uint8_t*)p;
+	for (int i = 0; i < len; i++)
+		crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFFu;
+}
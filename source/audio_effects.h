@@ -15,32 +15,80 @@ namespace AudioEffects {
 		EFF_DELAY,
 		EFF_DISTORTION,
 		EFF_WAVESHAPER,
-		EFF_REVERB
+		EFF_REVERB,
+		EFF_COUNT
 	};
 
-	void BitCrush(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
+	#define MAX_EFFECT_ARGS 4
+	#define MAX_CHAIN_EFFECTS 16
+
+	//Typed parameter blocks, one per effect. Arguments coming from Lua are validated and converted once when
+	//the chain is compiled so the effects themselves never have to touch a container.
+	struct BitCrushParams { float quantize; float gain; };
+	struct DesampleParams { int rate; };
+	struct FilterParams { float coef; };
+	struct NormalizeParams { float targetPeak; };
+	struct CompressorParams { float threshold; float ratio; };
+	struct DelayParams { int delaySamples; float feedback; };
+	struct DistortionParams { float threshold; };
+	struct WaveShaperParams { float intensity; };
+	struct ReverbParams { float decay; float wetDry; float feedback; int size1, size2, size3, size4; };
+
+	union EffectParams {
+		BitCrushParams bitcrush;
+		DesampleParams desample;
+		FilterParams filter;
+		NormalizeParams normalize;
+		CompressorParams compressor;
+		DelayParams delay;
+		DistortionParams distortion;
+		WaveShaperParams waveshaper;
+		ReverbParams reverb;
+	};
+
+	//Memory for effects that carry state from one packet to the next. Each player gets their own so
+	//different speakers never bleed into each other and can be processed in parallel.
+	struct EffectState {
+		float delayBuffer[44100];
+		int delayPos;
+
+		float reverbBuf1[4410];
+		float reverbBuf2[5512];
+		float reverbBuf3[7350];
+		float reverbBuf4[8820];
+		float allPassBuf1[2205];
+		float allPassBuf2[1764];
+		int reverbPos1, reverbPos2, reverbPos3, reverbPos4;
+		int allPassPos1, allPassPos2;
+	};
+
+	#define EFFECT_STATE_LEN(member) ((int)(sizeof(((AudioEffects::EffectState*)0)->member) / sizeof(float)))
+
+	typedef void (*EffectFunc)(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState* state);
+
+	void BitCrush(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState*) {
+		const BitCrushParams& p = params.bitcrush;
 		for (int i = 0; i < samples; i++) {
 			//Signed shorts range from -32768 to 32767
 			//Let's quantize that a bit
 			float f = (float)sampleBuffer[i];
-			f /= args.at(0);
+			f /= p.quantize;
 			sampleBuffer[i] = (uint16_t)f;
-			sampleBuffer[i] *= args.at(0);
-			sampleBuffer[i] *= args.at(1);
+			sampleBuffer[i] *= p.quantize;
+			sampleBuffer[i] *= p.gain;
 		}
 	}
 
-	static uint16_t tempBuf[10 * 1024];
-	void Desample(uint16_t* inBuffer, int& samples, std::vector<float> args) {
-		assert(samples / (int)args.at(0) + 1 <= sizeof(tempBuf));
+	void Desample(uint16_t* inBuffer, int& samples, const EffectParams& params, EffectState*) {
+		//Compacts in place, the write index never overtakes the read index.
+		const int rate = params.desample.rate;
 		int outIdx = 0;
 		for (int i = 0; i < samples; i++) {
-			if (i % (int)args.at(0) == 0) continue;
+			if (i % rate == 0) continue;
 
-			tempBuf[outIdx] = inBuffer[i];
+			inBuffer[outIdx] = inBuffer[i];
 			outIdx++;
 		}
-		std::memcpy(inBuffer, tempBuf, outIdx * 2);
 		samples = outIdx;
 	}
 
@@ -56,13 +104,10 @@ namespace AudioEffects {
 	    return *reinterpret_cast<uint16_t*>(&signedSample);
 	}
 
-	void LowPassFilter(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.empty()) return;
-	    
-	    float coef = args.at(0);
-	    if (coef < 0.0f) coef = 0.0f;
-	    if (coef > 1.0f) coef = 1.0f;
-	    
+	void LowPassFilter(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState*) {
+	    if (samples <= 0) return;
+
+	    const float coef = params.filter.coef;
 	    float prev = u16_to_float(sampleBuffer[0]);
 	    
 	    for (int i = 1; i < samples; i++) {
@@ -73,13 +118,10 @@ namespace AudioEffects {
 	    }
 	}
 	
-	void HighPassFilter(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.empty()) return;
-	    
-	    float coef = args.at(0);
-	    if (coef < 0.0f) coef = 0.0f;
-	    if (coef > 1.0f) coef = 1.0f;
-	    
+	void HighPassFilter(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState*) {
+	    if (samples <= 0) return;
+
+	    const float coef = params.filter.coef;
 	    float prevInput = u16_to_float(sampleBuffer[0]);
 	    float prevOutput = 0.0f;
 	    
@@ -92,13 +134,10 @@ namespace AudioEffects {
 	    }
 	}
 	
-	void Normalize(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.empty() || samples == 0) return;
-	    
-	    float targetPeak = args.at(0);
-	    if (targetPeak < 0.0f) targetPeak = 0.0f;
-	    if (targetPeak > 1.0f) targetPeak = 1.0f;
-	    
+	void Normalize(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState*) {
+	    if (samples == 0) return;
+
+	    const float targetPeak = params.normalize.targetPeak;
 	    float maxVal = 0.0f;
 	    for (int i = 0; i < samples; i++) {
 	        float val = u16_to_float(sampleBuffer[i]);
@@ -117,13 +156,9 @@ namespace AudioEffects {
 	    }
 	}
 	
-	void Compressor(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.size() < 2) return;
-	    
-	    float threshold = args.at(0) / 32768.0f;
-	    float ratio = args.at(1);
-	    if (ratio < 1.0f) ratio = 1.0f;
-	    
+	void Compressor(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState*) {
+	    const float threshold = params.compressor.threshold;
+	    const float ratio = params.compressor.ratio;
 	    for (int i = 0; i < samples; i++) {
 	        float val = u16_to_float(sampleBuffer[i]);
 	        float absVal = (val < 0) ? -val : val;
@@ -139,15 +174,11 @@ namespace AudioEffects {
 	    }
 	}
 	
-	static float delayBuffer[44100];
-	static int delayPos = 0;
-	
-	void Delay(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.size() < 2) return;
-	    
-	    int delaySamples = (int)args.at(0);
-	    float feedback = args.at(1) / 255.0f;
-	    
+	void Delay(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState* state) {
+	    const int delaySamples = params.delay.delaySamples;
+	    const float feedback = params.delay.feedback;
+	    float* delayBuffer = state->delayBuffer;
+	    int& delayPos = state->delayPos;
 	    for (int i = 0; i < samples; i++) {
 	        float input = u16_to_float(sampleBuffer[i]);
 	        float delayed = delayBuffer[delayPos];
@@ -159,12 +190,8 @@ namespace AudioEffects {
 	    }
 	}
 	
-	void Distortion(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.empty()) return;
-	    
-	    float threshold = args.at(0) / 32768.0f;
-	    if (threshold > 1.0f) threshold = 1.0f;
-	    
+	void Distortion(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState*) {
+	    const float threshold = params.distortion.threshold;
 	    for (int i = 0; i < samples; i++) {
 	        float val = u16_to_float(sampleBuffer[i]);
 	        if (val > threshold) val = threshold;
@@ -173,13 +200,10 @@ namespace AudioEffects {
 	    }
 	}
 	
-	void WaveShaper(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.empty() || samples <= 0) return;
-	    
-	    float intensity = args.at(0);
-	    if (intensity < 0.0f) intensity = 0.0f;
-	    if (intensity > 1.0f) intensity = 1.0f;
-	    
+	void WaveShaper(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState*) {
+	    if (samples <= 0) return;
+
+	    const float intensity = params.waveshaper.intensity;
 	    for (int i = 0; i < samples; i++) {
 	        int16_t* signedSample = reinterpret_cast<int16_t*>(&sampleBuffer[i]);
 	        float val = *signedSample / 32768.0f;
@@ -194,37 +218,28 @@ namespace AudioEffects {
 	    }
 	}
 
-	static float reverbBuf1[4410];
-	static float reverbBuf2[5512];
-	static float reverbBuf3[7350];
-	static float reverbBuf4[8820];
-	static float allPassBuf1[2205];
-	static float allPassBuf2[1764];
-	
-	static int reverbPos1 = 0, reverbPos2 = 0, reverbPos3 = 0, reverbPos4 = 0;
-	static int allPassPos1 = 0, allPassPos2 = 0;
-	
-	void Reverb(uint16_t* sampleBuffer, int& samples, std::vector<float> args) {
-	    if (args.size() < 3) return;
-	    
-	    float roomSize = args.at(0) / 255.0f;
-	    float decay = args.at(1) / 255.0f;
-	    float wetDry = args.at(2) / 255.0f;
-	    
-	    float feedback = 0.5f + decay * 0.4f;
-	    
-	    int size1 = (int)(sizeof(reverbBuf1) / sizeof(float) * roomSize);
-	    int size2 = (int)(sizeof(reverbBuf2) / sizeof(float) * roomSize);
-	    int size3 = (int)(sizeof(reverbBuf3) / sizeof(float) * roomSize);
-	    int size4 = (int)(sizeof(reverbBuf4) / sizeof(float) * roomSize);
-	    int sizeAP1 = sizeof(allPassBuf1) / sizeof(float);
-	    int sizeAP2 = sizeof(allPassBuf2) / sizeof(float);
-	    
-	    if (size1 < 10) size1 = 10;
-	    if (size2 < 10) size2 = 10;
-	    if (size3 < 10) size3 = 10;
-	    if (size4 < 10) size4 = 10;
-	    
+	void Reverb(uint16_t* sampleBuffer, int& samples, const EffectParams& params, EffectState* state) {
+	    const ReverbParams& p = params.reverb;
+	    const float decay = p.decay;
+	    const float wetDry = p.wetDry;
+	    const float feedback = p.feedback;
+	    const int size1 = p.size1, size2 = p.size2, size3 = p.size3, size4 = p.size4;
+	    const int sizeAP1 = EFFECT_STATE_LEN(allPassBuf1);
+	    const int sizeAP2 = EFFECT_STATE_LEN(allPassBuf2);
+
+	    float* reverbBuf1 = state->reverbBuf1;
+	    float* reverbBuf2 = state->reverbBuf2;
+	    float* reverbBuf3 = state->reverbBuf3;
+	    float* reverbBuf4 = state->reverbBuf4;
+	    float* allPassBuf1 = state->allPassBuf1;
+	    float* allPassBuf2 = state->allPassBuf2;
+	    int& reverbPos1 = state->reverbPos1;
+	    int& reverbPos2 = state->reverbPos2;
+	    int& reverbPos3 = state->reverbPos3;
+	    int& reverbPos4 = state->reverbPos4;
+	    int& allPassPos1 = state->allPassPos1;
+	    int& allPassPos2 = state->allPassPos2;
+
 	    for (int i = 0; i < samples; i++) {
 	        float input = u16_to_float(sampleBuffer[i]);
 	        
@@ -281,4 +296,163 @@ namespace AudioEffects {
 	        if (allPassPos2 >= sizeAP2) allPassPos2 = 0;
 	    }
 	}
+
+	inline float clampf(float val, float lo, float hi) {
+	    if (val < lo) return lo;
+	    if (val > hi) return hi;
+	    return val;
+	}
+
+	inline int reverbSize(int bufLen, float roomSize) {
+	    int size = (int)(bufLen * roomSize);
+	    if (size < 10) size = 10;
+	    if (size > bufLen) size = bufLen;
+	    return size;
+	}
+
+	struct EffectStage {
+		int id;
+		EffectFunc func;
+		EffectParams params;
+	};
+
+	//A compiled, fixed-size effect chain. Built once when a player's effects are configured and then only read by
+	//the voice hook, so running it never allocates.
+	struct EffectChain {
+		EffectStage stages[MAX_CHAIN_EFFECTS];
+		int count = 0;
+
+		//state may only be null if NeedsState() is false.
+		void Run(uint16_t* sampleBuffer, int& samples, EffectState* state) const {
+			for (int i = 0; i < count; i++) {
+				stages[i].func(sampleBuffer, samples, stages[i].params, state);
+			}
+		}
+
+		//An empty chain leaves audio untouched, so there's no point decoding and re-encoding it.
+		bool IsIdentity() const {
+			return count == 0;
+		}
+
+		bool NeedsState() const {
+			for (int i = 0; i < count; i++) {
+				if (stages[i].id == EFF_DELAY || stages[i].id == EFF_REVERB)
+					return true;
+			}
+			return false;
+		}
+	};
+
+	//Validates an effect's Lua arguments and converts them into its typed parameter block.
+	//Returns false if the effect is unknown or doesn't have enough arguments, in which case it should be left out of the chain.
+	bool CompileEffect(int id, const float* args, int nargs, EffectStage& out) {
+		out.id = id;
+		std::memset(&out.params, 0, sizeof(out.params));
+
+		switch (id) {
+		case EFF_BITCRUSH:
+			if (nargs < 2 || args[0] == 0.0f) return false;
+			out.func = BitCrush;
+			out.params.bitcrush = { args[0], args[1] };
+			return true;
+		case EFF_DESAMPLE:
+			if (nargs < 1 || (int)args[0] < 1) return false;
+			out.func = Desample;
+			out.params.desample = { (int)args[0] };
+			return true;
+		case EFF_LPF:
+			if (nargs < 1) return false;
+			out.func = LowPassFilter;
+			out.params.filter = { clampf(args[0], 0.0f, 1.0f) };
+			return true;
+		case EFF_HPF:
+			if (nargs < 1) return false;
+			out.func = HighPassFilter;
+			out.params.filter = { clampf(args[0], 0.0f, 1.0f) };
+			return true;
+		case EFF_NORMALIZE:
+			if (nargs < 1) return false;
+			out.func = Normalize;
+			out.params.normalize = { clampf(args[0], 0.0f, 1.0f) };
+			return true;
+		case EFF_COMPRESSOR:
+			if (nargs < 2) return false;
+			out.func = Compressor;
+			out.params.compressor = { args[0] / 32768.0f, args[1] < 1.0f ? 1.0f : args[1] };
+			return true;
+		case EFF_DELAY: {
+			if (nargs < 2) return false;
+			const int maxDelay = EFFECT_STATE_LEN(delayBuffer);
+			int delaySamples = (int)args[0];
+			if (delaySamples < 1) delaySamples = 1;
+			if (delaySamples > maxDelay) delaySamples = maxDelay;
+			out.func = Delay;
+			out.params.delay = { delaySamples, args[1] / 255.0f };
+			return true;
+		}
+		case EFF_DISTORTION: {
+			if (nargs < 1) return false;
+			float threshold = args[0] / 32768.0f;
+			if (threshold > 1.0f) threshold = 1.0f;
+			out.func = Distortion;
+			out.params.distortion = { threshold };
+			return true;
+		}
+		case EFF_WAVESHAPER:
+			if (nargs < 1) return false;
+			out.func = WaveShaper;
+			out.params.waveshaper = { clampf(args[0], 0.0f, 1.0f) };
+			return true;
+		case EFF_REVERB: {
+			if (nargs < 3) return false;
+			float roomSize = args[0] / 255.0f;
+			float decay = args[1] / 255.0f;
+			ReverbParams& p = out.params.reverb;
+			p.decay = decay;
+			p.wetDry = args[2] / 255.0f;
+			p.feedback = 0.5f + decay * 0.4f;
+			p.size1 = reverbSize(EFFECT_STATE_LEN(reverbBuf1), roomSize);
+			p.size2 = reverbSize(EFFECT_STATE_LEN(reverbBuf2), roomSize);
+			p.size3 = reverbSize(EFFECT_STATE_LEN(reverbBuf3), roomSize);
+			p.size4 = reverbSize(EFFECT_STATE_LEN(reverbBuf4), roomSize);
+			out.func = Reverb;
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+
+	//True for stages that leave the samples as they are (up to float rounding), e.g. a bitcrush with a quantization
+	//and gain of 1 or a wet/dry mix of 0. These are dropped from compiled chains.
+	bool IsNoOpStage(const EffectStage& stage) {
+		const EffectParams& p = stage.params;
+
+		switch (stage.id) {
+		case EFF_BITCRUSH:
+			return p.bitcrush.quantize == 1.0f && p.bitcrush.gain == 1.0f;
+		case EFF_LPF:
+			return p.filter.coef == 1.0f;
+		case EFF_COMPRESSOR:
+			return p.compressor.ratio == 1.0f;
+		case EFF_DISTORTION:
+			return p.distortion.threshold >= 1.0f;
+		case EFF_WAVESHAPER:
+			return p.waveshaper.intensity == 0.0f;
+		case EFF_REVERB:
+			return p.reverb.wetDry == 0.0f;
+		default:
+			return false;
+		}
+	}
+
+	//Compiles an effect onto the end of the chain. Unknown, invalid and no-op effects are left out.
+	void AddEffect(EffectChain& chain, int id, const float* args, int nargs) {
+		if (chain.count >= MAX_CHAIN_EFFECTS)
+			return;
+
+		EffectStage& stage = chain.stages[chain.count];
+		if (CompileEffect(id, args, nargs, stage) && !IsNoOpStage(stage))
+			chain.count++;
+	}
 }
@@ -0,0 +1,146 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+#include "ivoicecodec.h"
+#include "opus_framedecoder.h"
+#include "scratch_arena.h"
+
+//Player codecs, created up front so turning effects on and off never has to create or destroy Opus state.
+//Codecs are handed back reset, the next player to check one out starts clean. If more are checked out than the pool
+//was sized for it grows, those are kept for reuse too.
+//
+//The initial codecs live in one arena, a cache line aligned slab each: the codec object, then room for its Opus
+//decoder and encoder states. A state is only initialized in place when the codec first decodes or encodes, so a player
+//that's only tapped never sets up an encoder. The slab belongs to its codec for good, Reset() only marks the states
+//unused so the next talk burst initializes them again as if the codec had been reset. Codecs the pool grows by are
+//allocated on their own and create their states on the heap, Reset() frees those.
+//Game thread only.
+class CodecPool {
+private:
+	CodecPool(const CodecPool&) = delete;
+	CodecPool& operator=(const CodecPool&) = delete;
+
+public:
+	CodecPool() {}
+
+	~CodecPool() {
+		for (size_t i = 0; i < m_all.size(); i++) {
+			if (i < m_arenaCount)
+				m_all[i]->~Opus_FrameDecoder();
+			else
+				delete m_all[i];
+		}
+	}
+
+	void Init(size_t count) {
+		size_t objectSize = (sizeof(SteamOpus::Opus_FrameDecoder) + ScratchArena::ALIGNMENT - 1) & ~(ScratchArena::ALIGNMENT - 1);
+		m_arena.Init(count, objectSize + SteamOpus::Opus_FrameDecoder::StateSize());
+
+		m_all.reserve(count);
+		m_free.reserve(count);
+		for (size_t i = 0; i < count; i++) {
+			char* slab = m_arena.GetBlock(i);
+			SteamOpus::Opus_FrameDecoder* codec = new (slab) SteamOpus::Opus_FrameDecoder(slab + objectSize);
+			codec->Init(5, SAMPLERATE_GMOD_OPUS);
+
+			m_all.push_back(codec);
+			m_free.push_back(codec);
+		}
+		m_arenaCount = count;
+	}
+
+	IVoiceCodec* Acquire() {
+		if (m_free.empty()) {
+			SteamOpus::Opus_FrameDecoder* codec = new SteamOpus::Opus_FrameDecoder();
+			codec->Init(5, SAMPLERATE_GMOD_OPUS);
+
+			m_all.push_back(codec);
+			m_free.push_back(codec);
+			m_grown++;
+		}
+
+		IVoiceCodec* codec = m_free.back();
+		m_free.pop_back();
+
+		size_t inUse = InUse();
+		if (inUse > m_peak)
+			m_peak = inUse;
+
+		return codec;
+	}
+
+	//The codec must not be in use anywhere anymore, workers included.
+	void Release(IVoiceCodec* codec) {
+		if (codec == nullptr)
+			return;
+
+		SteamOpus::Opus_FrameDecoder* opus = (SteamOpus::Opus_FrameDecoder*)codec;
+		opus->ReleaseState();
+		opus->SetEncoderSettings(-1, -1, -1);
+		m_free.push_back(opus);
+	}
+
+	//Drops a checked out codec's Opus states, same rules as Release. Returns false if it had none.
+	bool Reset(IVoiceCodec* codec) {
+		SteamOpus::Opus_FrameDecoder* opus = (SteamOpus::Opus_FrameDecoder*)codec;
+		if (!opus->HasState())
+			return false;
+
+		opus->ReleaseState();
+		return true;
+	}
+
+	size_t Size() const {
+		return m_all.size();
+	}
+
+	size_t InUse() const {
+		return m_all.size() - m_free.size();
+	}
+
+	size_t Peak() const {
+		return m_peak;
+	}
+
+	//Codecs created past the initial size because the pool ran dry.
+	size_t Grown() const {
+		return m_grown;
+	}
+
+	//Opus decoder and encoder states set up right now. Workers set them up, so this is a snapshot.
+	size_t DecodersInUse() const {
+		size_t count = 0;
+		for (SteamOpus::Opus_FrameDecoder* codec : m_all) {
+			if (codec->HasDecoder())
+				count++;
+		}
+		return count;
+	}
+
+	size_t EncodersInUse() const {
+		size_t count = 0;
+		for (SteamOpus::Opus_FrameDecoder* codec : m_all) {
+			if (codec->HasEncoder())
+				count++;
+		}
+		return count;
+	}
+
+	//Bytes of the arena, and of each codec's slab in it.
+	size_t ArenaBytes() const {
+		return m_arena.GetTotalSize();
+	}
+
+	size_t SlabBytes() const {
+		return m_arena.GetBlockSize();
+	}
+
+private:
+	ScratchArena m_arena;
+	size_t m_arenaCount = 0;
+	std::vector<SteamOpus::Opus_FrameDecoder*> m_all;
+	std::vector<SteamOpus::Opus_FrameDecoder*> m_free;
+	size_t m_peak = 0;
+	size_t m_grown = 0;
+};
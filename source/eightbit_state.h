@@ -1,12 +1,63 @@
 #pragma once
 #include <string>
-#include <unordered_map>
 #include "audio_effects.h"
-#include <functional>
+#include "scratch_arena.h"
+#include "codec_pool.h"
+#include "encode_budget.h"
+#include "voice_stats.h"
+#include <vector>
+#include <chrono>
+#include <bitset>
 
-struct Effect {
-	int eff_id;
-	std::vector<float> eff_args;
+class PcmTap;
+
+//Opus encoder settings for re-encoded voice, -1 leaves a setting at its default.
+struct EncoderSettings {
+	int complexity = -1;
+	int bitrate = -1;
+	int vbr = -1;
+};
+
+//Garry's Mod caps maxplayers at 128.
+#define GMOD_MAX_PLAYERS 128
+
+//Per-player voice state, indexed by player slot.
+//A player is afflicted when it owns a codec and the slot still belongs to the userid that configured it.
+struct PlayerVoiceState {
+	int userid = -1;
+	IVoiceCodec* codec = nullptr;
+	AudioEffects::EffectChain chain;
+	//Only allocated for chains with stateful effects (delay, reverb).
+	AudioEffects::EffectState* effectState = nullptr;
+	//The player's block of the scratch arena, see VOICE_SCRATCH_BLOCK.
+	char* decompressBuf = nullptr;
+	char* recompressBuf = nullptr;
+	//Packets relayed from this slot in the framed format.
+	uint32_t relaySequence = 0;
+	//The slot's entry in EightbitState::stats.
+	VoiceStats::PlayerStats* stats = nullptr;
+	//Decoded samples go here while set, see eightbit.EnablePcmTap. Needs a codec even without effects.
+	PcmTap* tap = nullptr;
+	//Last time a packet reached the codec, for resetting idle players' codecs.
+	uint64_t lastVoiceNs = 0;
+	//Overrides EightbitState::encoder where set, only while the codec still belongs to encoderUserid.
+	EncoderSettings encoder;
+	int encoderUserid = -1;
+};
+
+enum RelayFormat {
+	//The Steam voice packet with its steamid replaced by the speaker's real one.
+	RELAY_FORMAT_RAW,
+	//relay_protocol.h
+	RELAY_FORMAT_FRAMED
+};
+
+enum RelayTransport {
+	RELAY_TRANSPORT_UDP,
+	//Shared memory ring for a consumer on the same host, shm_ring.h
+	RELAY_TRANSPORT_SHM,
+	//One length prefixed TCP stream, reconnected when it drops
+	RELAY_TRANSPORT_TCP
 };
 
 struct EightbitState {
@@ -16,17 +67,30 @@ struct EightbitState {
 	int desampleRate = 2;
 	uint16_t port = 4000;
 	std::string ip = "127.0.0.1";
-	std::unordered_map<int, std::tuple<IVoiceCodec*, std::vector<Effect>>> afflictedPlayers;
-	std::unordered_map<int, std::function<void(uint16_t*, int&, std::vector<float>)>> effects_functions = {
-	    {AudioEffects::EFF_BITCRUSH, AudioEffects::BitCrush},
-	    {AudioEffects::EFF_DESAMPLE, AudioEffects::Desample},
-		{AudioEffects::EFF_LPF, AudioEffects::LowPassFilter},
-		{AudioEffects::EFF_HPF, AudioEffects::HighPassFilter},
-		{AudioEffects::EFF_NORMALIZE, AudioEffects::Normalize},
-		{AudioEffects::EFF_COMPRESSOR, AudioEffects::Compressor},
-		{AudioEffects::EFF_DELAY, AudioEffects::Delay},
-		{AudioEffects::EFF_DISTORTION, AudioEffects::Distortion},
-		{AudioEffects::EFF_WAVESHAPER, AudioEffects::WaveShaper},
-		{AudioEffects::EFF_REVERB, AudioEffects::Reverb}
-	};
+	int relayFormat = RELAY_FORMAT_RAW;
+	//With relayFiltered only slots in relayMask are relayed, and only while they still hold the userid they were
+	//selected with, see eightbit.SetRelayMask.
+	bool relayFiltered = false;
+	std::bitset<GMOD_MAX_PLAYERS> relayMask;
+	int relayMaskUserids[GMOD_MAX_PLAYERS];
+	//Packets older than this when a worker picks them up are passed through unprocessed.
+	int asyncMaxLatencyMs = 50;
+	//Sized once for maxplayers at module open, never resized afterwards.
+	std::vector<PlayerVoiceState> players;
+	//Per-player decode/encode scratch memory, one block per player slot.
+	ScratchArena scratch;
+	//Players holding an AudioEffects::EffectState, see AllocEffectState.
+	size_t effectStates = 0;
+	//Every player's codec is checked out of here and handed back when they no longer need it.
+	CodecPool codecs;
+	//A player's codec is reset after this long without talking, 0 never does. See ResetIdleCodecs.
+	int codecIdleTimeoutS = 300;
+	//Encoder settings for every player without their own.
+	EncoderSettings encoder;
+	//Caps complexity when encoding takes too long, see eightbit.SetEncodeBudget.
+	EncodeBudget encodeBudget;
+	//Latency histograms, one set per player slot.
+	VoiceStats::PlayerStats* stats = nullptr;
+	VoiceStats::TickClock clock;
+	std::chrono::steady_clock::time_point statsWindowStart;
 };
@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+
+#define ENCODE_COMPLEXITY_MAX 10
+//Server frames in a row over budget before complexity is lowered a step.
+#define ENCODE_BUDGET_OVER_FRAMES 5
+//Server frames in a row under half the budget before it's raised a step again.
+#define ENCODE_BUDGET_UNDER_FRAMES 200
+
+//Caps every player's encoder complexity so the encode time of a server frame, summed over all speakers, stays within a
+//budget. Voice packets don't arrive evenly across frames, so it reacts to a moving average rather than single frames,
+//and backs off fast but recovers slowly. Game thread only.
+class EncodeBudget {
+public:
+	//0 turns it off and lifts the cap.
+	void SetBudgetNs(double budgetNs) {
+		m_budgetNs = budgetNs;
+		m_cap = ENCODE_COMPLEXITY_MAX;
+		m_primed = false;
+		m_averageNs = 0;
+		m_over = 0;
+		m_under = 0;
+	}
+
+	bool IsEnabled() const {
+		return m_budgetNs > 0;
+	}
+
+	double GetBudgetNs() const {
+		return m_budgetNs;
+	}
+
+	//Highest complexity any encoder may use right now.
+	int GetCap() const {
+		return m_cap;
+	}
+
+	double GetAverageNs() const {
+		return m_averageNs;
+	}
+
+	//Called once per server frame with the encode time recorded so far, in ticks, over all players.
+	//Returns true if the cap changed.
+	bool Update(uint64_t totalTicks, double nsPerTick) {
+		if (!IsEnabled())
+			return false;
+
+		uint64_t ticks = totalTicks - m_lastTicks;
+		m_lastTicks = totalTicks;
+		if (!m_primed) {
+			m_primed = true;
+			return false;
+		}
+
+		m_averageNs += (ticks * nsPerTick - m_averageNs) / 8;
+
+		if (m_averageNs > m_budgetNs && m_cap > 0) {
+			m_under = 0;
+			if (++m_over < ENCODE_BUDGET_OVER_FRAMES)
+				return false;
+
+			m_cap--;
+			m_over = 0;
+			return true;
+		}
+
+		if (m_averageNs < m_budgetNs / 2 && m_cap < ENCODE_COMPLEXITY_MAX) {
+			m_over = 0;
+			if (++m_under < ENCODE_BUDGET_UNDER_FRAMES)
+				return false;
+
+			m_cap++;
+			m_under = 0;
+			return true;
+		}
+
+		m_over = 0;
+		m_under = 0;
+		return false;
+	}
+
+private:
+	double m_budgetNs = 0;
+	int m_cap = ENCODE_COMPLEXITY_MAX;
+	bool m_primed = false;
+	uint64_t m_lastTicks = 0;
+	double m_averageNs = 0;
+	int m_over = 0;
+	int m_under = 0;
+};
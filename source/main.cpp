@@ -6,8 +6,8 @@
 #include <scanning/symbolfinder.hpp>
 #include <detouring/hook.hpp>
 #include <iostream>
+#include <vector>
 #include <iclient.h>
-#include <unordered_map>
 #include "ivoicecodec.h"
 #include "audio_effects.h"
 #include "net.h"
@@ -16,11 +16,22 @@
 #include "eightbit_state.h"
 #include <GarrysMod/Symbol.hpp>
 #include <cstdint>
+#include <chrono>
 #include "opus_framedecoder.h"
+#include "voice_pipeline.h"
+#include "voice_capture.h"
+#include "relay_protocol.h"
+#include "shm_relay.h"
+#include "voice_inject.h"
+#include "voice_mixer.h"
+#include "pcm_tap.h"
 #include <netmessages.h>
+#include <inetchannel.h>
 #include <iserver.h>
 
 #define STEAM_PCKT_SZ sizeof(uint64_t) + sizeof(CRC32_t)
+//Framed relay datagrams stop taking more packets past this size.
+#define RELAY_FRAMED_MTU 1200
 #ifdef SYSTEM_WINDOWS
 	#include <windows.h>
 
@@ -42,21 +53,227 @@
 	};
 #endif
 
-static char decompressedBuffer[20 * 1024];
-static char recompressBuffer[20 * 1024];
-
 Net* net_handl = nullptr;
 EightbitState* g_eightbit = nullptr;
+VoicePipeline* g_pipeline = nullptr;
+VoiceCapture* g_capture = nullptr;
+//Replaces the UDP relay while set, see eightbit.SetRelayTransport.
+ShmRelay* g_shmRelay = nullptr;
+VoiceInjector* g_injector = nullptr;
+//Relays one mixed stream instead of every speaker while set, see eightbit.SetRelayMixdown.
+VoiceMixer* g_mixer = nullptr;
 IServer* sv = nullptr;
 
 typedef void (*SV_BroadcastVoiceData)(IClient* cl, int nBytes, char* data, int64 xuid);
 Detouring::Hook detour_BroadcastVoiceData;
 
+//Room for SVC_VoiceData's own fields on top of the payload.
+#define VOICE_MSG_OVERHEAD 64
+
+//Serialized SVC_VoiceData, built at most once per variant per broadcast: [proximity][0 = zero length "is talking", 1 = full payload].
+//Game thread only.
+static char voiceWireBuf[2][2][VOICE_MAX_RECOMPRESSED + VOICE_MSG_OVERHEAD];
+
+//SVC_VoiceData that writes bits serialized beforehand instead of serializing itself again. Everything else, its type
+//and group included, is SVC_VoiceData's, so the netchannel treats it exactly like the engine's own voice message.
+class SVC_PrebuiltVoiceData : public SVC_VoiceData {
+public:
+	bf_write* m_pPrebuilt = nullptr;
+
+	bool WriteToBuffer(bf_write& buffer) override {
+		return buffer.WriteBits(m_pPrebuilt->GetData(), m_pPrebuilt->GetNumBitsWritten());
+	}
+};
+
+//Sends an already compressed voice packet from cl to everyone that should hear it, the way the engine would.
+//https://github.com/uvbs/source-2007/blob/d07be8d02519ff5c902e1eb6430e028e1b302c8b/src_main/engine/sv_main.cpp#L1561C1-L1612C2
+//Rather than having every listener's netchannel serialize the message again, each variant is bit packed once and the
+//resulting bits go through the listeners' netchannels as a voice message, into the same stream SendNetMsg would use.
+void BroadcastVoiceToClients(IClient* cl, char* data, int nBytes, int64 xuid) {
+	// Build voice message once
+	SVC_VoiceData voiceData;
+	voiceData.m_nFromClient = cl->GetPlayerSlot();
+	voiceData.m_nLength = nBytes * 8;	// length in bits
+	voiceData.m_DataOut = data;
+	voiceData.m_xuid = xuid;
+
+	bf_write wire[2][2];
+	bool built[2][2] = {};
+	SVC_PrebuiltVoiceData prebuilt;
+	bool canPrebuild = nBytes <= VOICE_MAX_RECOMPRESSED;
+
+	for(int i=0; i < sv->GetClientCount(); i++)
+	{
+		IClient *pDestClient = sv->GetClient(i);
+
+		bool bSelf = (pDestClient == cl);
+
+		// Only send voice to active clients
+		if( !pDestClient->IsActive() )
+			continue;
+
+		// Does the game code want cl sending to this client?
+
+		bool bHearsPlayer = pDestClient->IsHearingClient( voiceData.m_nFromClient );
+		bool bProximity = pDestClient->IsProximityHearingClient( voiceData.m_nFromClient );
+
+		if ( !bHearsPlayer && !bSelf )
+			continue;	
+
+		// Is loopback enabled? If not, still send something, just zero length (this is so the client 
+		// can display something that shows knows the server knows it's talking).
+		int nLength = bHearsPlayer ? nBytes * 8 : 0;
+
+		INetChannel* chan = pDestClient->GetNetChannel();
+		if (canPrebuild && chan != nullptr && !pDestClient->IsFakeClient()) {
+			bf_write& msg = wire[bProximity][bHearsPlayer];
+
+			if (!built[bProximity][bHearsPlayer]) {
+				msg.StartWriting(voiceWireBuf[bProximity][bHearsPlayer], sizeof(voiceWireBuf[bProximity][bHearsPlayer]));
+				voiceData.m_bProximity = bProximity;
+				voiceData.m_nLength = nLength;
+				voiceData.WriteToBuffer(msg);
+				built[bProximity][bHearsPlayer] = true;
+			}
+
+			if (!msg.IsOverflowed()) {
+				prebuilt.m_nFromClient = voiceData.m_nFromClient;
+				prebuilt.m_bProximity = bProximity;
+				prebuilt.m_nLength = nLength;
+				prebuilt.m_xuid = xuid;
+				prebuilt.m_DataOut = data;
+				prebuilt.m_pPrebuilt = &msg;
+				chan->SendNetMsg(prebuilt, false, true);
+				continue;
+			}
+		}
+
+		voiceData.m_bProximity = bProximity;
+		voiceData.m_nLength = nLength;
+		pDestClient->SendNetMsg( voiceData );
+	}
+}
+
+//The client's real steamid64.
+//Notice that we don't use the conveniently provided one in the voice packet. The client can manipulate that one.
+uint64_t GetClientSteamID64(IClient* cl) {
+#if defined ARCHITECTURE_X86
+	return *(uint64_t*)((char*)cl + 181);
+#else
+	return *(uint64_t*)((char*)cl + 189);
+#endif
+}
+
+uint64_t GetMonotonicNs() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Relay datagrams go to whichever transport is active. Game thread only.
+char* BeginRelayPacket(uint32_t maxLen) {
+	return g_shmRelay != nullptr ? g_shmRelay->BeginPacket(maxLen) : net_handl->BeginPacket(maxLen);
+}
+
+void CommitRelayPacket(uint32_t len) {
+	if (g_shmRelay != nullptr)
+		g_shmRelay->CommitPacket(len);
+	else
+		net_handl->CommitPacket(len);
+}
+
+void FlushRelay() {
+	if (g_shmRelay != nullptr)
+		g_shmRelay->Flush();
+	else
+		net_handl->Flush();
+}
+
+//Datagram the framed relay format is currently filling, open until the end of the frame or until it's full.
+//Game thread only.
+static RelayProtocol::Writer relayFramer;
+static uint32_t relayDatagramSeq = 0;
+
+void FinishRelayDatagram() {
+	if (relayFramer.IsOpen())
+		CommitRelayPacket((uint32_t)relayFramer.Finish());
+}
+
+//Adds a packet to the current framed relay datagram, see relay_protocol.h.
+void AppendFramedPacket(const RelayProtocol::PacketInfo& info, const char* payload) {
+	//Datagrams are kept under a typical path MTU, a packet that's bigger on its own still goes out alone.
+	if (relayFramer.IsOpen() && (!relayFramer.Fits(info.length) || relayFramer.Size() + RelayProtocol::PACKET_HEADER_SIZE + info.length > RELAY_FRAMED_MTU))
+		FinishRelayDatagram();
+
+	if (!relayFramer.IsOpen()) {
+		//Sized up for a packet that needs more than a usual datagram, so it always fits in a fresh one. A transport that
+		//can't carry that drops it and counts it.
+		uint32_t size = std::max<uint32_t>(NET_MAX_DATAGRAM, RelayProtocol::DATAGRAM_HEADER_SIZE + RelayProtocol::PACKET_HEADER_SIZE + info.length);
+		char* buf = BeginRelayPacket(size);
+		if (buf == nullptr)
+			return;
+
+		relayFramer.Begin(buf, size, relayDatagramSeq++);
+	}
+
+	relayFramer.Append(info, payload);
+}
+
+void RelayFramedPacket(IClient* cl, int slot, PlayerVoiceState* player, const char* data, int nBytes) {
+	RelayProtocol::PacketInfo info;
+	info.timestampNs = GetMonotonicNs();
+	info.steamid = GetClientSteamID64(cl);
+	info.sequence = player != nullptr ? player->relaySequence++ : 0;
+	info.slot = (uint16_t)slot;
+	info.flags = 0;
+	info.length = (uint16_t)(nBytes - sizeof(uint64_t));
+
+	if (player != nullptr && player->codec != nullptr && player->userid == cl->GetUserID() && !player->chain.IsIdentity())
+		info.flags |= RelayProtocol::FLAG_EFFECTS;
+
+	AppendFramedPacket(info, data + sizeof(uint64_t));
+}
+
+//Relays the mixdown blocks that are due. Packets carry a steamid of 0, in the framed format they get their own slot.
+void RelayMixdown() {
+	static uint32_t mixSequence = 0;
+
+	g_mixer->Mix(GetMonotonicNs(), [](const char* data, int nBytes) {
+		if (g_eightbit->relayFormat == RELAY_FORMAT_FRAMED) {
+			RelayProtocol::PacketInfo info;
+			info.timestampNs = GetMonotonicNs();
+			info.steamid = 0;
+			info.sequence = mixSequence++;
+			info.slot = RelayProtocol::MIXDOWN_SLOT;
+			info.flags = RelayProtocol::FLAG_MIXDOWN;
+			info.length = (uint16_t)(nBytes - sizeof(uint64_t));
+			AppendFramedPacket(info, data + sizeof(uint64_t));
+			return;
+		}
+
+		char* relayBuffer = BeginRelayPacket(nBytes);
+		if (relayBuffer == nullptr)
+			return;
+
+		std::memcpy(relayBuffer, data, nBytes);
+		CommitRelayPacket(nBytes);
+	});
+}
+
+//Whether the relay selection lets cl's voice through. Checked before anything is copied.
+bool IsRelayed(IClient* cl, int slot) {
+	if (!g_eightbit->relayFiltered)
+		return true;
+
+	return slot >= 0 && slot < GMOD_MAX_PLAYERS && g_eightbit->relayMask.test(slot) && g_eightbit->relayMaskUserids[slot] == cl->GetUserID();
+}
+
 void hook_BroadcastVoiceData(IClient* cl, uint nBytes, char* data, int64 xuid) {
 	//Check if the player is in the set of enabled players.
 	//This is (and needs to be) and O(1) operation for how often this function is called.
 	//If not in the set, just hit the trampoline to ensure default behavior.
-	int uid = cl->GetUserID();
+	int slot = cl->GetPlayerSlot();
+
+	if (g_capture->IsRunning())
+		g_capture->Submit(GetMonotonicNs(), slot, GetClientSteamID64(cl), data, nBytes);
 
 #ifdef THIRDPARTY_LINK
 	if(checkIfMuted(cl->GetPlayerSlot()+1)) {
@@ -64,58 +281,58 @@ void hook_BroadcastVoiceData(IClient* cl, uint nBytes, char* data, int64 xuid) {
 	}
 #endif
 
-	auto& afflicted_players = g_eightbit->afflictedPlayers;
-	if (g_eightbit->broadcastPackets && nBytes > sizeof(uint64_t)) {
-		//Get the user's steamid64, put it at the beginning of the buffer.
-		//Notice that we don't use the conveniently provided one in the voice packet. The client can manipulate that one.
-
-#if defined ARCHITECTURE_X86
-		uint64_t id64 = *(uint64_t*)((char*)cl + 181);
-#else
-		uint64_t id64 = *(uint64_t*)((char*)cl + 189);
-#endif
+	PlayerVoiceState* player = (slot >= 0 && slot < (int)g_eightbit->players.size()) ? &g_eightbit->players[slot] : nullptr;
 
-		*(uint64_t*)decompressedBuffer = id64;
+	if (g_eightbit->broadcastPackets && nBytes > sizeof(uint64_t) && nBytes <= NET_MAX_DATAGRAM && IsRelayed(cl, slot)) {
+		uint64_t relayStart = VoiceStats::ReadTicks();
 
-		//Transfer the packet data to our scratch buffer
-		//This looks jank, but it's to prevent a theoretically malformed packet triggering a massive memcpy
-		size_t toCopy = nBytes - sizeof(uint64_t);
-		std::memcpy(decompressedBuffer + sizeof(uint64_t), data + sizeof(uint64_t), toCopy);
+		if (g_mixer != nullptr) {
+			//Only decoded here, the mix goes out from eightbit_think.
+			g_mixer->Submit(slot, cl->GetUserID(), data, nBytes, GetMonotonicNs());
+		}
+		else if (g_eightbit->relayFormat == RELAY_FORMAT_FRAMED) {
+			RelayFramedPacket(cl, slot, player, data, nBytes);
+		}
+		else {
+			//The packet is built straight into the relay ring, it goes out at the end of the frame.
+			char* relayBuffer = BeginRelayPacket(nBytes);
+			if (relayBuffer != nullptr) {
+				//Get the user's steamid64, put it at the beginning of the buffer.
+				*(uint64_t*)relayBuffer = GetClientSteamID64(cl);
+
+				//Transfer the packet data to our scratch buffer
+				//This looks jank, but it's to prevent a theoretically malformed packet triggering a massive memcpy
+				size_t toCopy = nBytes - sizeof(uint64_t);
+				std::memcpy(relayBuffer + sizeof(uint64_t), data + sizeof(uint64_t), toCopy);
+				CommitRelayPacket(nBytes);
+			}
+		}
 
-		//Finally we'll broadcast our new packet
- 		net_handl->SendPacket(g_eightbit->ip.c_str(), g_eightbit->port, decompressedBuffer, nBytes);
+		if (player != nullptr)
+			player->stats->stages[VoiceStats::STAGE_RELAY].Record(VoiceStats::ReadTicks() - relayStart);
 	}
 
-	if (afflicted_players.find(uid) != afflicted_players.end()) {
-		IVoiceCodec* codec = std::get<0>(afflicted_players.at(uid));
+	if (player != nullptr && player->codec != nullptr && player->userid == cl->GetUserID()) {
+		IVoiceCodec* codec = player->codec;
+		player->lastVoiceNs = GetMonotonicNs();
 
-		if(nBytes < STEAM_PCKT_SZ) {
+		//Nothing in the chain would change the audio, skip the decode/encode round trip entirely.
+		if(nBytes < STEAM_PCKT_SZ || (player->chain.IsIdentity() && player->tap == nullptr)) {
 			return detour_BroadcastVoiceData.GetTrampoline<SV_BroadcastVoiceData>()(cl, nBytes, data, xuid);
 		}
 
-		int bytesDecompressed = SteamVoice::DecompressIntoBuffer(codec, data, nBytes, decompressedBuffer, sizeof(decompressedBuffer));
-		int samples = bytesDecompressed / 2;
-		if (bytesDecompressed <= 0) {
-			//Just hit the trampoline at this point.
-			return detour_BroadcastVoiceData.GetTrampoline<SV_BroadcastVoiceData>()(cl, nBytes, data, xuid);
+		//Async mode: hand the packet to the worker pool, it gets broadcast from eightbit_think once processed.
+		if (g_pipeline != nullptr) {
+			//A full queue drops the packet, see VoicePipeline::Submit.
+			g_pipeline->Submit(slot, *player, data, nBytes, xuid);
+			return;
 		}
 
-		#ifdef _DEBUG
-			std::cout << "Decompressed samples " << samples << std::endl;
-		#endif
-
-		//Apply audio effect
-		std::vector<Effect> effs = std::get<1>(afflicted_players.at(uid));
-		std::unordered_map<int, std::function<void(uint16_t*, int&, std::vector<float>)>> eff_funcs = g_eightbit->effects_functions;
-		for (int i = 0; i < effs.size(); i++){
-			Effect eff = effs.at(i);
-			eff_funcs[eff.eff_id]((uint16_t*)&decompressedBuffer, samples, eff.eff_args);
-		}
-		
-		//Recompress the stream
-		uint64_t steamid = *(uint64_t*)data;
-		int bytesWritten = SteamVoice::CompressIntoBuffer(steamid, codec, decompressedBuffer, samples*2, recompressBuffer, sizeof(recompressBuffer), 24000);
+		//Decompress, apply audio effects and recompress the stream
+		int bytesWritten = ProcessVoicePacket(codec, player->chain, player->effectState, data, nBytes,
+			player->decompressBuf, VOICE_DECOMPRESS_SCRATCH, player->recompressBuf, VOICE_MAX_RECOMPRESSED, player->stats, player->tap);
 		if (bytesWritten <= 0) {
+			//Just hit the trampoline at this point.
 			return detour_BroadcastVoiceData.GetTrampoline<SV_BroadcastVoiceData>()(cl, nBytes, data, xuid);
 		}
 
@@ -124,53 +341,101 @@ void hook_BroadcastVoiceData(IClient* cl, uint nBytes, char* data, int64 xuid) {
 		#endif
 
 		//Broadcast voice data with our updated compressed data.
-		//return detour_BroadcastVoiceData.GetTrampoline<SV_BroadcastVoiceData>()(cl, bytesWritten, recompressBuffer, xuid);
+		uint64_t fanoutStart = VoiceStats::ReadTicks();
+		BroadcastVoiceToClients(cl, player->recompressBuf, bytesWritten, xuid);
+		player->stats->stages[VoiceStats::STAGE_FANOUT].Record(VoiceStats::ReadTicks() - fanoutStart);
+	}
+	else {
+		return detour_BroadcastVoiceData.GetTrampoline<SV_BroadcastVoiceData>()(cl, nBytes, data, xuid);
+	}
+}
 
-		//https://github.com/uvbs/source-2007/blob/d07be8d02519ff5c902e1eb6430e028e1b302c8b/src_main/engine/sv_main.cpp#L1561C1-L1612C2
-	
-		// Build voice message once
-		SVC_VoiceData voiceData;
-		voiceData.m_nFromClient = cl->GetPlayerSlot();
-		voiceData.m_nLength = bytesWritten * 8;	// length in bits
-		voiceData.m_DataOut = recompressBuffer;
-		voiceData.m_xuid = xuid;
+//Translates a userid into a player slot, or -1 if no such player is connected.
+//Only used when configuring players, never from the voice hook.
+int GetPlayerSlotForUserID(int userid) {
+	if (sv == nullptr)
+		return -1;
 
-		for(int i=0; i < sv->GetClientCount(); i++)
-		{
-			IClient *pDestClient = sv->GetClient(i);
+	for (int i = 0; i < sv->GetClientCount(); i++) {
+		IClient* client = sv->GetClient(i);
+		if (client != nullptr && client->IsConnected() && client->GetUserID() == userid)
+			return client->GetPlayerSlot();
+	}
 
-			bool bSelf = (pDestClient == cl);
+	return -1;
+}
 
-			// Only send voice to active clients
-			if( !pDestClient->IsActive() )
-				continue;
+//Pushes the player's encoder settings, their own over the global ones and capped by the encode budget, to their codec.
+void ApplyEncoderSettings(PlayerVoiceState& player) {
+	if (player.codec == nullptr)
+		return;
+
+	EncoderSettings settings = g_eightbit->encoder;
+	if (player.encoderUserid == player.userid) {
+		if (player.encoder.complexity >= 0)
+			settings.complexity = player.encoder.complexity;
+		if (player.encoder.bitrate >= 0)
+			settings.bitrate = player.encoder.bitrate;
+		if (player.encoder.vbr >= 0)
+			settings.vbr = player.encoder.vbr;
+	}
+
+	int cap = g_eightbit->encodeBudget.GetCap();
+	if (cap < ENCODE_COMPLEXITY_MAX)
+		settings.complexity = settings.complexity >= 0 ? std::min(settings.complexity, cap) : cap;
 
-			// Does the game code want cl sending to this client?
+	((SteamOpus::Opus_FrameDecoder*)player.codec)->SetEncoderSettings(settings.complexity, settings.bitrate, settings.vbr);
+}
 
-			bool bHearsPlayer = pDestClient->IsHearingClient( voiceData.m_nFromClient );
-			voiceData.m_bProximity = pDestClient->IsProximityHearingClient( voiceData.m_nFromClient );
+//Delay and reverb state lives outside the scratch arena: at ~330 KB a player it's only allocated for players whose
+//chain needs it, see eightbit.GetCodecPoolStats for what's live.
+void AllocEffectState(PlayerVoiceState& player) {
+	if (player.effectState != nullptr)
+		return;
 
-			if ( !bHearsPlayer && !bSelf )
-				continue;	
+	player.effectState = new AudioEffects::EffectState();
+	g_eightbit->effectStates++;
+}
 
-			voiceData.m_nLength = bytesWritten * 8;
+void FreeEffectState(PlayerVoiceState& player) {
+	if (player.effectState == nullptr)
+		return;
 
-			// Is loopback enabled?
-			if( !bHearsPlayer )
-			{
-				// Still send something, just zero length (this is so the client 
-				// can display something that shows knows the server knows it's talking).
-				voiceData.m_nLength = 0;	
-			}
+	delete player.effectState;
+	player.effectState = nullptr;
+	g_eightbit->effectStates--;
+}
 
-			pDestClient->SendNetMsg( voiceData );
-		}
-	}
-	else {
-		return detour_BroadcastVoiceData.GetTrampoline<SV_BroadcastVoiceData>()(cl, nBytes, data, xuid);
+void ApplyEncoderSettingsToAll() {
+	for (auto& player : g_eightbit->players) {
+		ApplyEncoderSettings(player);
 	}
 }
 
+//Reads {complexity, bitrate, vbr} from the table at idx, anything missing is -1.
+EncoderSettings ReadEncoderSettings(GarrysMod::Lua::ILuaBase* LUA, int idx) {
+	EncoderSettings settings;
+	if (!LUA->IsType(idx, GarrysMod::Lua::Type::Table))
+		return settings;
+
+	LUA->GetField(idx, "complexity");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+		settings.complexity = std::max(0, std::min((int)LUA->GetNumber(-1), ENCODE_COMPLEXITY_MAX));
+	LUA->Pop(1);
+
+	LUA->GetField(idx, "bitrate");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+		settings.bitrate = (int)LUA->GetNumber(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(idx, "vbr");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+		settings.vbr = LUA->GetBool(-1) ? 1 : 0;
+	LUA->Pop(1);
+
+	return settings;
+}
+
 LUA_FUNCTION_STATIC(eightbit_crush) {
 	g_eightbit->crushFactor = (int)LUA->GetNumber(1);
 	return 0;
@@ -183,11 +448,26 @@ LUA_FUNCTION_STATIC(eightbit_gain) {
 
 LUA_FUNCTION_STATIC(eightbit_setbroadcastip) {
 	g_eightbit->ip = std::string(LUA->GetString());
+	net_handl->SetPrimaryTarget(g_eightbit->ip.c_str(), g_eightbit->port);
 	return 0;
 }
 
 LUA_FUNCTION_STATIC(eightbit_setbroadcastport) {
 	g_eightbit->port = (uint16_t)LUA->GetNumber(1);
+	net_handl->SetPrimaryTarget(g_eightbit->ip.c_str(), g_eightbit->port);
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(eightbit_addrelaytarget) {
+	const char* ip = LUA->CheckString(1);
+	uint16_t port = (uint16_t)LUA->CheckNumber(2);
+
+	LUA->PushBool(net_handl->AddTarget(ip, port));
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(eightbit_clearrelaytargets) {
+	net_handl->ClearExtraTargets();
 	return 0;
 }
 
@@ -196,6 +476,52 @@ LUA_FUNCTION_STATIC(eightbit_broadcast) {
 	return 0;
 }
 
+//SetRelayMask({userid, ...}) relays only those players, SetRelayMask() relays everyone again.
+LUA_FUNCTION_STATIC(eightbit_setrelaymask) {
+	g_eightbit->relayMask.reset();
+	g_eightbit->relayFiltered = LUA->IsType(1, GarrysMod::Lua::Type::Table);
+	if (!g_eightbit->relayFiltered)
+		return 0;
+
+	LUA->Push(1);
+	LUA->PushNil();
+	while (LUA->Next(-2)) {
+		int userid = (int)LUA->GetNumber(-1);
+		int slot = GetPlayerSlotForUserID(userid);
+		if (slot >= 0 && slot < GMOD_MAX_PLAYERS) {
+			g_eightbit->relayMask.set(slot);
+			g_eightbit->relayMaskUserids[slot] = userid;
+		}
+		LUA->Pop(1);
+	}
+	LUA->Pop(1);
+	return 0;
+}
+
+//SetRelayPlayer(userid, bool) adds or removes one player from the relay selection. Turns the selection on, starting
+//out empty, if it wasn't already. Returns false if the player doesn't exist.
+LUA_FUNCTION_STATIC(eightbit_setrelayplayer) {
+	int userid = (int)LUA->CheckNumber(1);
+	bool relayed = LUA->GetBool(2);
+
+	int slot = GetPlayerSlotForUserID(userid);
+	if (slot < 0 || slot >= GMOD_MAX_PLAYERS) {
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	if (!g_eightbit->relayFiltered) {
+		g_eightbit->relayMask.reset();
+		g_eightbit->relayFiltered = true;
+	}
+
+	g_eightbit->relayMask.set(slot, relayed);
+	g_eightbit->relayMaskUserids[slot] = userid;
+
+	LUA->PushBool(true);
+	return 1;
+}
+
 LUA_FUNCTION_STATIC(eightbit_getcrush) {
 	LUA->PushNumber(g_eightbit->crushFactor);
 	return 1;
@@ -206,45 +532,757 @@ LUA_FUNCTION_STATIC(eightbit_setdesamplerate) {
 	return 0;
 }
 
+LUA_FUNCTION_STATIC(eightbit_startcapture) {
+	const char* path = LUA->CheckString(1);
+	uint64_t maxMB = LUA->IsType(2, GarrysMod::Lua::Type::Number) ? (uint64_t)LUA->GetNumber(2) : 256;
+
+	LUA->PushBool(g_capture->Start(path, maxMB * 1024 * 1024));
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(eightbit_stopcapture) {
+	//Stop lets the writer drain what's still queued, the counts are only final after it.
+	g_capture->Stop();
+
+	LUA->PushNumber((double)g_capture->GetWrittenCount());
+	LUA->PushNumber((double)g_capture->GetDroppedCount());
+	return 2;
+}
+
+LUA_FUNCTION_STATIC(eightbit_setasyncworkers) {
+	int workers = (int)LUA->GetNumber(1);
+
+	//Packets still queued in the old pool are dropped, it's only ever a frame's worth.
+	delete g_pipeline;
+	g_pipeline = nullptr;
+
+	if (workers > 0)
+		g_pipeline = new VoicePipeline((int)g_eightbit->players.size(), workers, g_eightbit->asyncMaxLatencyMs);
+
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(eightbit_setasyncmaxlatency) {
+	g_eightbit->asyncMaxLatencyMs = (int)LUA->GetNumber(1);
+	if (g_pipeline != nullptr)
+		g_pipeline->SetMaxLatency(g_eightbit->asyncMaxLatencyMs);
+	return 0;
+}
+
+//Returns {workers, max_latency_ms, dropped, expired}: dropped packets didn't fit their speaker's queue, expired ones
+//waited longer than max_latency_ms and went out unprocessed. Counted since SetAsyncWorkers last started the pool.
+LUA_FUNCTION_STATIC(eightbit_getasyncstats) {
+	LUA->CreateTable();
+	LUA->PushNumber(g_pipeline != nullptr ? g_pipeline->GetWorkerCount() : 0);
+	LUA->SetField(-2, "workers");
+	LUA->PushNumber(g_eightbit->asyncMaxLatencyMs);
+	LUA->SetField(-2, "max_latency_ms");
+	LUA->PushNumber(g_pipeline != nullptr ? (double)g_pipeline->GetDroppedCount() : 0);
+	LUA->SetField(-2, "dropped");
+	LUA->PushNumber(g_pipeline != nullptr ? (double)g_pipeline->GetExpiredCount() : 0);
+	LUA->SetField(-2, "expired");
+	return 1;
+}
+
+//Player each injected stream speaks as, by userid and the slot it had when it was assigned. Game thread only.
+static int injectUserids[INJECT_MAX_STREAMS];
+static int injectSlots[INJECT_MAX_STREAMS];
+static char injectBuf[sizeof(uint64_t) + INJECT_MAX_PACKET];
+
+//Plays injected voice that's due this frame through the same fan-out as processed voice.
+void PlayInjectedVoice() {
+	g_injector->Play(VoiceInjector::NowNs(), [](int stream, const InjectPacket& pkt) {
+		IClient* cl = sv->GetClient(injectSlots[stream]);
+		if (cl == nullptr || !cl->IsConnected() || cl->GetUserID() != injectUserids[stream])
+			return;
+
+		//Rebuild the full Steam packet. Like the relay, the speaker's real steamid, not whatever the sender put in.
+		uint64_t steamid = GetClientSteamID64(cl);
+		*(uint64_t*)injectBuf = steamid;
+		std::memcpy(injectBuf + sizeof(uint64_t), pkt.data, pkt.length);
+
+		BroadcastVoiceToClients(cl, injectBuf, sizeof(uint64_t) + pkt.length, steamid);
+	});
+}
+
+//Broadcasts a packet the async pipeline is done with.
+void BroadcastPipelineResult(int slot, VoicePipeline::Result& res) {
+	IClient* cl = sv->GetClient(slot);
+
+	//The speaker left while their packet was being processed.
+	if (cl == nullptr || !cl->IsConnected() || cl->GetUserID() != res.userid)
+		return;
+
+	if (res.processed) {
+		uint64_t fanoutStart = VoiceStats::ReadTicks();
+		BroadcastVoiceToClients(cl, res.data, res.nBytes, res.xuid);
+		g_eightbit->stats[slot].stages[VoiceStats::STAGE_FANOUT].Record(VoiceStats::ReadTicks() - fanoutStart);
+	}
+	else
+		detour_BroadcastVoiceData.GetTrampoline<SV_BroadcastVoiceData>()(cl, res.nBytes, res.data, res.xuid);
+}
+
+//Resets the codec of players who haven't talked in codecIdleTimeoutS, the next packet sets the Opus state up again from
+//scratch. Only codecs the pool grew by free memory doing so, see CodecPool. Checked once a second.
+void ResetIdleCodecs() {
+	static uint64_t lastCheckNs = 0;
+	uint64_t now = GetMonotonicNs();
+	if (g_eightbit->codecIdleTimeoutS <= 0 || now - lastCheckNs < 1000000000ull)
+		return;
+
+	lastCheckNs = now;
+	uint64_t timeoutNs = (uint64_t)g_eightbit->codecIdleTimeoutS * 1000000000ull;
+
+	for (size_t slot = 0; slot < g_eightbit->players.size(); slot++) {
+		PlayerVoiceState& player = g_eightbit->players[slot];
+		if (player.codec == nullptr || now - player.lastVoiceNs < timeoutNs)
+			continue;
+
+		//Nothing of theirs can still be queued after this long, but the state mustn't go while a worker holds it.
+		if (g_pipeline != nullptr)
+			g_pipeline->WaitIdle((int)slot, BroadcastPipelineResult);
+
+		g_eightbit->codecs.Reset(player.codec);
+	}
+}
+
+//Gives the mixer's codecs for speakers who left, or haven't talked in codecIdleTimeoutS, back to the pool. Checked once
+//a second.
+void ReleaseMixerSpeakers() {
+	static uint64_t lastCheckNs = 0;
+	uint64_t now = GetMonotonicNs();
+	if (now - lastCheckNs < 1000000000ull)
+		return;
+
+	lastCheckNs = now;
+	uint64_t timeoutNs = (uint64_t)g_eightbit->codecIdleTimeoutS * 1000000000ull;
+
+	g_mixer->ReleaseSpeakers([&](int slot, int userid, uint64_t lastVoiceNs) {
+		IClient* cl = sv->GetClient(slot);
+		if (cl == nullptr || !cl->IsConnected() || cl->GetUserID() != userid)
+			return true;
+
+		return g_eightbit->codecIdleTimeoutS > 0 && now - lastVoiceNs >= timeoutNs;
+	});
+}
+
+//Feeds the frame's encode time to the budget and re-caps every encoder if it moved.
+void UpdateEncodeBudget() {
+	if (!g_eightbit->encodeBudget.IsEnabled())
+		return;
+
+	uint64_t totalTicks = 0;
+	for (size_t slot = 0; slot < g_eightbit->players.size(); slot++) {
+		totalTicks += g_eightbit->stats[slot].stages[VoiceStats::STAGE_COMPRESS].GetSum();
+	}
+
+	if (g_eightbit->encodeBudget.Update(totalTicks, g_eightbit->clock.NsPerTick()))
+		ApplyEncoderSettingsToAll();
+}
+
+//Runs once per server frame from the Think hook.
+LUA_FUNCTION_STATIC(eightbit_think) {
+	if (g_mixer != nullptr) {
+		RelayMixdown();
+		ReleaseMixerSpeakers();
+	}
+
+	//Everything relayed during the frame goes out in one batch.
+	FinishRelayDatagram();
+	FlushRelay();
+
+	if (g_injector->IsRunning())
+		PlayInjectedVoice();
+
+	if (g_pipeline != nullptr) {
+		g_pipeline->DrainCompleted(BroadcastPipelineResult);
+	}
+
+	UpdateEncodeBudget();
+	ResetIdleCodecs();
+	return 0;
+}
+
+//SetEncoderSettings({complexity = 0-10, bitrate = bits/s, vbr = bool}) for every player, missing fields go back to
+//the Opus defaults.
+LUA_FUNCTION_STATIC(eightbit_setencodersettings) {
+	g_eightbit->encoder = ReadEncoderSettings(LUA, 1);
+	ApplyEncoderSettingsToAll();
+	return 0;
+}
+
+//SetPlayerEncoderSettings(userid, {complexity, bitrate, vbr}) overrides the global settings for one player,
+//SetPlayerEncoderSettings(userid) drops the override. Returns false if the player doesn't exist.
+LUA_FUNCTION_STATIC(eightbit_setplayerencodersettings) {
+	int userid = (int)LUA->CheckNumber(1);
+	int slot = GetPlayerSlotForUserID(userid);
+	if (slot < 0 || slot >= (int)g_eightbit->players.size()) {
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	PlayerVoiceState& player = g_eightbit->players[slot];
+	player.encoder = ReadEncoderSettings(LUA, 2);
+	player.encoderUserid = userid;
+	ApplyEncoderSettings(player);
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+//SetEncodeBudget(microseconds) lowers every encoder's complexity while encoding takes longer than this per server
+//frame, summed over all speakers, and raises it again once there's room. 0 turns it off.
+LUA_FUNCTION_STATIC(eightbit_setencodebudget) {
+	g_eightbit->encodeBudget.SetBudgetNs(LUA->GetNumber(1) * 1000.0);
+	ApplyEncoderSettingsToAll();
+	return 0;
+}
+
+//Returns {budget_us, average_us, complexity_cap}.
+LUA_FUNCTION_STATIC(eightbit_getencodebudget) {
+	LUA->CreateTable();
+	LUA->PushNumber(g_eightbit->encodeBudget.GetBudgetNs() / 1000.0);
+	LUA->SetField(-2, "budget_us");
+	LUA->PushNumber(g_eightbit->encodeBudget.GetAverageNs() / 1000.0);
+	LUA->SetField(-2, "average_us");
+	LUA->PushNumber(g_eightbit->encodeBudget.GetCap());
+	LUA->SetField(-2, "complexity_cap");
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(eightbit_setcodecidletimeout) {
+	g_eightbit->codecIdleTimeoutS = (int)LUA->GetNumber(1);
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(eightbit_setrelayformat) {
+	FinishRelayDatagram();
+	g_eightbit->relayFormat = (int)LUA->GetNumber(1);
+	return 0;
+}
+
+//SetRelayTransport(RELAY_TRANSPORT_UDP), SetRelayTransport(RELAY_TRANSPORT_SHM, name, [sizeKB]) or
+//SetRelayTransport(RELAY_TRANSPORT_TCP, ip, port, [backlogKB])
+//Returns whether the transport could be set up, the UDP relay stays active if not.
+LUA_FUNCTION_STATIC(eightbit_setrelaytransport) {
+	int transport = (int)LUA->GetNumber(1);
+
+	FinishRelayDatagram();
+	delete g_shmRelay;
+	g_shmRelay = nullptr;
+	net_handl->DisableTcp();
+
+	if (transport == RELAY_TRANSPORT_TCP) {
+		const char* ip = LUA->CheckString(2);
+		uint16_t port = (uint16_t)LUA->CheckNumber(3);
+		uint64_t backlogKB = LUA->IsType(4, GarrysMod::Lua::Type::Number) ? (uint64_t)LUA->GetNumber(4) : NET_TCP_BACKLOG_DEFAULT / 1024;
+
+		//Connecting happens on the sender thread, this only checks the address.
+		LUA->PushBool(net_handl->SetTcpTarget(ip, port, (uint32_t)std::min<uint64_t>(backlogKB * 1024, UINT32_MAX)));
+		return 1;
+	}
+
+	if (transport == RELAY_TRANSPORT_SHM) {
+		const char* name = LUA->CheckString(2);
+		uint64_t sizeKB = LUA->IsType(3, GarrysMod::Lua::Type::Number) ? (uint64_t)LUA->GetNumber(3) : 1024;
+
+		ShmRelay* relay = new ShmRelay();
+		if (!relay->Create(name, sizeKB * 1024)) {
+			delete relay;
+			LUA->PushBool(false);
+			return 1;
+		}
+		g_shmRelay = relay;
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+//SetRelayMixdown(true) relays every speaker mixed into one stream instead of one stream per speaker.
+LUA_FUNCTION_STATIC(eightbit_setrelaymixdown) {
+	bool enable = LUA->GetBool(1);
+
+	if (enable && g_mixer == nullptr)
+		g_mixer = new VoiceMixer(g_eightbit->codecs, (int)g_eightbit->players.size());
+	else if (!enable) {
+		delete g_mixer;
+		g_mixer = nullptr;
+	}
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(eightbit_setrelaydroppolicy) {
+	net_handl->SetDropPolicy((Net::DropPolicy)(int)LUA->GetNumber(1));
+	return 0;
+}
+
+//StartInject(port, [addr], [{peer, ...}]) binds addr, loopback by default. With peers given only their datagrams are
+//accepted.
+LUA_FUNCTION_STATIC(eightbit_startinject) {
+	uint16_t port = (uint16_t)LUA->CheckNumber(1);
+	const char* addr = LUA->IsType(2, GarrysMod::Lua::Type::String) ? LUA->GetString(2) : "127.0.0.1";
+
+	std::vector<std::string> peers;
+	if (LUA->IsType(3, GarrysMod::Lua::Type::Table)) {
+		LUA->Push(3);
+		LUA->PushNil();
+		while (LUA->Next(-2)) {
+			if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+				peers.push_back(LUA->GetString(-1));
+			LUA->Pop(1);
+		}
+		LUA->Pop(1);
+	}
+
+	LUA->PushBool(g_injector->Start(port, addr, peers));
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(eightbit_stopinject) {
+	g_injector->Stop();
+	return 0;
+}
+
+//SetInjectStream(stream, userid) makes the stream speak as that player, SetInjectStream(stream) turns it off.
+//The player is normally a bot. Returns false if the stream or the player doesn't exist.
+LUA_FUNCTION_STATIC(eightbit_setinjectstream) {
+	int stream = (int)LUA->CheckNumber(1);
+	if (stream < 0 || stream >= INJECT_MAX_STREAMS) {
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	int slot = -1;
+	int userid = -1;
+	if (LUA->IsType(2, GarrysMod::Lua::Type::Number)) {
+		userid = (int)LUA->GetNumber(2);
+		slot = GetPlayerSlotForUserID(userid);
+		if (slot < 0) {
+			LUA->PushBool(false);
+			return 1;
+		}
+	}
+
+	injectUserids[stream] = userid;
+	injectSlots[stream] = slot;
+	g_injector->SetStreamEnabled(stream, slot >= 0);
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+//Returns {[stream] = {received, queue_dropped, late, overflow, played, delay_ms}} for every assigned stream, and
+//{rejected} for datagrams from senders that aren't peers.
+LUA_FUNCTION_STATIC(eightbit_getinjectstats) {
+	LUA->CreateTable();
+	for (int stream = 0; stream < INJECT_MAX_STREAMS; stream++) {
+		if (injectSlots[stream] < 0)
+			continue;
+
+		const JitterBuffer& jitter = g_injector->GetJitter(stream);
+		LUA->PushNumber(stream);
+		LUA->CreateTable();
+		LUA->PushNumber((double)g_injector->GetReceivedCount(stream));
+		LUA->SetField(-2, "received");
+		LUA->PushNumber((double)g_injector->GetQueueDroppedCount(stream));
+		LUA->SetField(-2, "queue_dropped");
+		LUA->PushNumber((double)jitter.late);
+		LUA->SetField(-2, "late");
+		LUA->PushNumber((double)jitter.overflow);
+		LUA->SetField(-2, "overflow");
+		LUA->PushNumber((double)jitter.played);
+		LUA->SetField(-2, "played");
+		LUA->PushNumber(jitter.TargetDelayNs() / 1e6);
+		LUA->SetField(-2, "delay_ms");
+		LUA->SetTable(-3);
+	}
+	LUA->PushNumber((double)g_injector->GetRejectedCount());
+	LUA->SetField(-2, "rejected");
+	return 1;
+}
+
+//Returns {enqueued, sent, dropped, batches, largest_batch, tcp_connected, tcp_connects, tcp_backlog_bytes,
+//tcp_backlog_dropped}, all counted since the module was loaded apart from the backlog's current size.
+//With the shared memory transport active also {shm_written, shm_dropped, shm_wakes} for it, with mixdown on also
+//{mixed_blocks}.
+LUA_FUNCTION_STATIC(eightbit_getrelaystats) {
+	LUA->CreateTable();
+	LUA->PushNumber((double)net_handl->GetEnqueuedCount());
+	LUA->SetField(-2, "enqueued");
+	LUA->PushNumber((double)net_handl->GetSentCount());
+	LUA->SetField(-2, "sent");
+	LUA->PushNumber((double)net_handl->GetDroppedCount());
+	LUA->SetField(-2, "dropped");
+	LUA->PushNumber((double)net_handl->GetBatchCount());
+	LUA->SetField(-2, "batches");
+	LUA->PushNumber(net_handl->GetLargestBatch());
+	LUA->SetField(-2, "largest_batch");
+	LUA->PushBool(net_handl->IsTcpConnected());
+	LUA->SetField(-2, "tcp_connected");
+	LUA->PushNumber((double)net_handl->GetTcpConnectCount());
+	LUA->SetField(-2, "tcp_connects");
+	LUA->PushNumber((double)net_handl->GetTcpBacklogBytes());
+	LUA->SetField(-2, "tcp_backlog_bytes");
+	LUA->PushNumber((double)net_handl->GetTcpBacklogDroppedCount());
+	LUA->SetField(-2, "tcp_backlog_dropped");
+
+	if (g_shmRelay != nullptr) {
+		LUA->PushNumber((double)g_shmRelay->GetWrittenCount());
+		LUA->SetField(-2, "shm_written");
+		LUA->PushNumber((double)g_shmRelay->GetDroppedCount());
+		LUA->SetField(-2, "shm_dropped");
+		LUA->PushNumber((double)g_shmRelay->GetWakeCount());
+		LUA->SetField(-2, "shm_wakes");
+	}
+
+	if (g_mixer != nullptr) {
+		LUA->PushNumber((double)g_mixer->GetMixedBlockCount());
+		LUA->SetField(-2, "mixed_blocks");
+	}
+	return 1;
+}
+
+//Returns {size, in_use, peak, grown, decoders, encoders, arena_bytes, slab_bytes, effect_states, effect_state_bytes}:
+//codecs in the pool, checked out right now, most ever checked out at once and created on demand because the pool ran
+//dry, Opus decoder and encoder states set up, the memory taken by the arena, in total and per codec, and the delay and
+//reverb states allocated outside it.
+LUA_FUNCTION_STATIC(eightbit_getcodecpoolstats) {
+	LUA->CreateTable();
+	LUA->PushNumber((double)g_eightbit->codecs.Size());
+	LUA->SetField(-2, "size");
+	LUA->PushNumber((double)g_eightbit->codecs.InUse());
+	LUA->SetField(-2, "in_use");
+	LUA->PushNumber((double)g_eightbit->codecs.Peak());
+	LUA->SetField(-2, "peak");
+	LUA->PushNumber((double)g_eightbit->codecs.Grown());
+	LUA->SetField(-2, "grown");
+	LUA->PushNumber((double)g_eightbit->codecs.DecodersInUse());
+	LUA->SetField(-2, "decoders");
+	LUA->PushNumber((double)g_eightbit->codecs.EncodersInUse());
+	LUA->SetField(-2, "encoders");
+	LUA->PushNumber((double)g_eightbit->codecs.ArenaBytes());
+	LUA->SetField(-2, "arena_bytes");
+	LUA->PushNumber((double)g_eightbit->codecs.SlabBytes());
+	LUA->SetField(-2, "slab_bytes");
+	LUA->PushNumber((double)g_eightbit->effectStates);
+	LUA->SetField(-2, "effect_states");
+	LUA->PushNumber((double)(g_eightbit->effectStates * sizeof(AudioEffects::EffectState)));
+	LUA->SetField(-2, "effect_state_bytes");
+	return 1;
+}
+
+//Pushes {count, sum_ns, mean_ns, p50_ns, p99_ns, p999_ns} for one histogram window.
+void PushHistogramWindow(GarrysMod::Lua::ILuaBase* LUA, const VoiceStats::LatencyHistogram::Snapshot& window, double nsPerTick) {
+	LUA->CreateTable();
+	LUA->PushNumber((double)window.count);
+	LUA->SetField(-2, "count");
+	LUA->PushNumber(window.sum * nsPerTick);
+	LUA->SetField(-2, "sum_ns");
+	LUA->PushNumber(window.count > 0 ? window.sum * nsPerTick / window.count : 0.0);
+	LUA->SetField(-2, "mean_ns");
+	LUA->PushNumber(window.Percentile(0.5) * nsPerTick);
+	LUA->SetField(-2, "p50_ns");
+	LUA->PushNumber(window.Percentile(0.99) * nsPerTick);
+	LUA->SetField(-2, "p99_ns");
+	LUA->PushNumber(window.Percentile(0.999) * nsPerTick);
+	LUA->SetField(-2, "p999_ns");
+}
+
+//Returns everything recorded since the previous call and starts a new window:
+//{ window_s, stages = {[name] = hist}, effects = {[EFF_*] = hist}, players = {[userid] = {[name] = hist}} }
+//Percentiles are bucket midpoints, good to about 10%.
+LUA_FUNCTION_STATIC(eightbit_getstats) {
+	static VoiceStats::LatencyHistogram::Snapshot window, stageTotal[VoiceStats::STAGE_COUNT], effectTotal[AudioEffects::EFF_COUNT];
+	double nsPerTick = g_eightbit->clock.NsPerTick();
+
+	for (int i = 0; i < VoiceStats::STAGE_COUNT; i++)
+		stageTotal[i].Clear();
+	for (int i = 0; i < AudioEffects::EFF_COUNT; i++)
+		effectTotal[i].Clear();
+
+	auto now = std::chrono::steady_clock::now();
+	LUA->CreateTable();
+	LUA->PushNumber(std::chrono::duration<double>(now - g_eightbit->statsWindowStart).count());
+	LUA->SetField(-2, "window_s");
+	g_eightbit->statsWindowStart = now;
+
+	LUA->CreateTable();
+	for (size_t slot = 0; slot < g_eightbit->players.size(); slot++) {
+		VoiceStats::PlayerStats& stats = g_eightbit->stats[slot];
+		IClient* cl = sv != nullptr ? sv->GetClient((int)slot) : nullptr;
+		bool pushed = false;
+
+		for (int i = 0; i < VoiceStats::STAGE_COUNT; i++) {
+			stats.stages[i].TakeWindow(stats.stageBase[i], window);
+			stageTotal[i].Add(window);
+			//Still counted in the totals if the player has left since.
+			if (window.count == 0 || cl == nullptr || !cl->IsConnected())
+				continue;
+
+			if (!pushed) {
+				LUA->PushNumber(cl->GetUserID());
+				LUA->CreateTable();
+				pushed = true;
+			}
+			PushHistogramWindow(LUA, window, nsPerTick);
+			LUA->SetField(-2, VoiceStats::StageNames[i]);
+		}
+
+		for (int i = 0; i < AudioEffects::EFF_COUNT; i++) {
+			stats.effects[i].TakeWindow(stats.effectBase[i], window);
+			effectTotal[i].Add(window);
+		}
+
+		if (pushed)
+			LUA->SetTable(-3);
+	}
+	LUA->SetField(-2, "players");
+
+	LUA->CreateTable();
+	for (int i = 0; i < VoiceStats::STAGE_COUNT; i++) {
+		PushHistogramWindow(LUA, stageTotal[i], nsPerTick);
+		LUA->SetField(-2, VoiceStats::StageNames[i]);
+	}
+	LUA->SetField(-2, "stages");
+
+	LUA->CreateTable();
+	for (int i = 0; i < AudioEffects::EFF_COUNT; i++) {
+		if (effectTotal[i].count == 0)
+			continue;
+
+		LUA->PushNumber(i);
+		PushHistogramWindow(LUA, effectTotal[i], nsPerTick);
+		LUA->SetTable(-3);
+	}
+	LUA->SetField(-2, "effects");
+
+	return 1;
+}
+
+//Times the SVC_VoiceData fan-out without sending anything: the message serializing itself for every listener (the
+//engine's way) against the SVC_PrebuiltVoiceData BroadcastVoiceToClients sends, built once per broadcast. Both are
+//written through INetMessage::WriteToBuffer like a netchannel's SendNetMsg would. Returns ns per broadcast for both.
+LUA_FUNCTION_STATIC(eightbit_benchmarkfanout) {
+	int listeners = LUA->IsType(1, GarrysMod::Lua::Type::Number) ? (int)LUA->GetNumber(1) : 64;
+	int payloadBytes = LUA->IsType(2, GarrysMod::Lua::Type::Number) ? (int)LUA->GetNumber(2) : 200;
+	int iterations = LUA->IsType(3, GarrysMod::Lua::Type::Number) ? (int)LUA->GetNumber(3) : 1000;
+	payloadBytes = std::max(1, std::min(payloadBytes, VOICE_MAX_RECOMPRESSED));
+	iterations = std::max(1, iterations);
+
+	//Its own buffers, voiceWireBuf belongs to the live fan-out.
+	std::vector<char> payload(VOICE_MAX_RECOMPRESSED);
+	std::vector<char> wireBuf(2 * (VOICE_MAX_RECOMPRESSED + VOICE_MSG_OVERHEAD));
+	std::vector<char> streamBuf(256 * 1024);
+	bf_write stream(streamBuf.data(), (int)streamBuf.size());
+	const int msgBits = (payloadBytes + VOICE_MSG_OVERHEAD) * 8;
+
+	SVC_VoiceData voiceData;
+	voiceData.m_nFromClient = 0;
+	voiceData.m_DataOut = payload.data();
+	voiceData.m_xuid = 0;
+
+	SVC_PrebuiltVoiceData prebuilt;
+	prebuilt.m_nFromClient = 0;
+	prebuilt.m_DataOut = payload.data();
+	prebuilt.m_xuid = 0;
+	prebuilt.m_nLength = payloadBytes * 8;
+
+	//Stands in for a listener's netchannel stream. Starts off byte aligned like a real one practically never is.
+	auto makeRoom = [&]() {
+		if (stream.GetNumBitsLeft() < msgBits) {
+			stream.Reset();
+			stream.WriteUBitLong(0, 3);
+		}
+	};
+
+	INetMessage& perClientMsg = voiceData;
+	auto start = std::chrono::steady_clock::now();
+	for (int it = 0; it < iterations; it++) {
+		for (int l = 0; l < listeners; l++) {
+			makeRoom();
+			voiceData.m_bProximity = (l & 1) != 0;
+			voiceData.m_nLength = payloadBytes * 8;
+			perClientMsg.WriteToBuffer(stream);
+		}
+	}
+	auto perClient = std::chrono::steady_clock::now() - start;
+
+	INetMessage& prebuiltMsg = prebuilt;
+	start = std::chrono::steady_clock::now();
+	for (int it = 0; it < iterations; it++) {
+		bf_write wire[2];
+		for (int p = 0; p < 2; p++) {
+			wire[p].StartWriting(&wireBuf[p * (VOICE_MAX_RECOMPRESSED + VOICE_MSG_OVERHEAD)], VOICE_MAX_RECOMPRESSED + VOICE_MSG_OVERHEAD);
+			voiceData.m_bProximity = p != 0;
+			voiceData.m_nLength = payloadBytes * 8;
+			voiceData.WriteToBuffer(wire[p]);
+		}
+
+		for (int l = 0; l < listeners; l++) {
+			makeRoom();
+			prebuilt.m_bProximity = (l & 1) != 0;
+			prebuilt.m_pPrebuilt = &wire[l & 1];
+			prebuiltMsg.WriteToBuffer(stream);
+		}
+	}
+	auto prebuiltTime = std::chrono::steady_clock::now() - start;
+
+	LUA->PushNumber((double)std::chrono::duration_cast<std::chrono::nanoseconds>(perClient).count() / iterations);
+	LUA->PushNumber((double)std::chrono::duration_cast<std::chrono::nanoseconds>(prebuiltTime).count() / iterations);
+	return 2;
+}
+
+//EnablePcmTap(userid, name, [decimate], [sizeKB]) writes the player's decoded voice into the shared memory ring
+//at /dev/shm/<name>, see pcm_tap.h. decimate makes it 16 kHz instead of 24 kHz. Returns whether the tap could be set up.
+LUA_FUNCTION_STATIC(eightbit_enablepcmtap) {
+	int userid = (int)LUA->CheckNumber(1);
+	const char* name = LUA->CheckString(2);
+	bool decimate = LUA->GetBool(3);
+	uint64_t sizeKB = LUA->IsType(4, GarrysMod::Lua::Type::Number) ? (uint64_t)LUA->GetNumber(4) : 256;
+
+	int slot = GetPlayerSlotForUserID(userid);
+	if (slot < 0 || slot >= (int)g_eightbit->players.size()) {
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	PlayerVoiceState& player = g_eightbit->players[slot];
+	if (g_pipeline != nullptr)
+		g_pipeline->WaitIdle(slot, BroadcastPipelineResult);
+
+	PcmTap* tap = new PcmTap(GetClientSteamID64(sv->GetClient(slot)), decimate);
+	if (!tap->Create(name, sizeKB * 1024)) {
+		delete tap;
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	if (player.codec != nullptr && player.userid != userid) {
+		//Left behind by a player that has since disconnected.
+		player.codec->ResetState();
+		player.chain = AudioEffects::EffectChain();
+		FreeEffectState(player);
+	}
+
+	if (player.codec == nullptr)
+		player.codec = g_eightbit->codecs.Acquire();
+
+	player.userid = userid;
+	delete player.tap;
+	player.tap = tap;
+	ApplyEncoderSettings(player);
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+//DisablePcmTap(userid) returns the records written and dropped for lack of room.
+LUA_FUNCTION_STATIC(eightbit_disablepcmtap) {
+	int slot = GetPlayerSlotForUserID((int)LUA->CheckNumber(1));
+	if (slot < 0 || slot >= (int)g_eightbit->players.size() || g_eightbit->players[slot].tap == nullptr)
+		return 0;
+
+	PlayerVoiceState& player = g_eightbit->players[slot];
+	if (g_pipeline != nullptr)
+		g_pipeline->WaitIdle(slot, BroadcastPipelineResult);
+
+	LUA->PushNumber((double)player.tap->GetWrittenCount());
+	LUA->PushNumber((double)player.tap->GetDroppedCount());
+
+	delete player.tap;
+	player.tap = nullptr;
+
+	//The codec was only there for the tap.
+	if (player.chain.IsIdentity()) {
+		g_eightbit->codecs.Release(player.codec);
+		player.codec = nullptr;
+	}
+	return 2;
+}
+
 LUA_FUNCTION_STATIC(eightbit_enableEffect) {
-	std::vector<Effect> effs;
-	std::vector<float> eff_args;
-	int eff;
+	//Compile the effect table into a fixed chain up front, the voice hook only ever runs the result.
+	AudioEffects::EffectChain chain;
+	float eff_args[MAX_EFFECT_ARGS];
+	int nargs;
+	int eff = AudioEffects::EFF_NONE;
+	bool onlyNone = true;
 	int id = LUA->GetNumber(1);
 	LUA->PushNil();
 
 	while (LUA->Next(-2)) {
 		eff = LUA->GetNumber(-2);
 		LUA->PushNil();
-		eff_args.clear();
+		nargs = 0;
         while (LUA->Next(-2)) {
-            eff_args.push_back(LUA->GetNumber(-1));
+            if (nargs < MAX_EFFECT_ARGS)
+                eff_args[nargs++] = (float)LUA->GetNumber(-1);
             LUA->Pop(1);
         }
-        effs.push_back({eff, eff_args});
+        if (eff != AudioEffects::EFF_NONE)
+            onlyNone = false;
+        AudioEffects::AddEffect(chain, eff, eff_args, nargs);
         LUA->Pop(1);
 	}
 
 	LUA->Pop();
 
-	auto& afflicted_players = g_eightbit->afflictedPlayers;
-	if (afflicted_players.find(id) != afflicted_players.end()) {
-		if (effs.size() == 1 && effs.at(0).eff_id == AudioEffects::EFF_NONE) {
-			IVoiceCodec* codec = std::get<0>(afflicted_players.at(id));
-			delete codec;
-			afflicted_players.erase(id);
+	int slot = GetPlayerSlotForUserID(id);
+	if (slot < 0 || slot >= (int)g_eightbit->players.size())
+		return 0;
+
+	PlayerVoiceState& player = g_eightbit->players[slot];
+
+	//Workers may still hold the codec for queued packets.
+	if (g_pipeline != nullptr)
+		g_pipeline->WaitIdle(slot, BroadcastPipelineResult);
+
+	if (player.codec != nullptr && player.userid != id) {
+		//The slot was left behind by a player that has since disconnected, start from a clean codec.
+		player.codec->ResetState();
+		player.userid = id;
+		player.chain = AudioEffects::EffectChain();
+		FreeEffectState(player);
+		delete player.tap;
+		player.tap = nullptr;
+	}
+
+	if (player.codec != nullptr) {
+		//A tapped player keeps their codec for decoding.
+		if (onlyNone && player.tap != nullptr) {
+			player.chain = AudioEffects::EffectChain();
+			FreeEffectState(player);
+			return 0;
+		}
+		else if (onlyNone) {
+			g_eightbit->codecs.Release(player.codec);
+			player.codec = nullptr;
+			player.chain = AudioEffects::EffectChain();
+			FreeEffectState(player);
+			return 0;
 		}
 		else {
-			std::get<1>(afflicted_players.at(id)) = effs;
+			//Coming out of pass-through the codec has missed every packet since, start it over.
+			if (player.chain.IsIdentity() && !chain.IsIdentity()) {
+				player.codec->ResetState();
+				if (player.effectState != nullptr)
+					std::memset(player.effectState, 0, sizeof(AudioEffects::EffectState));
+			}
+			player.chain = chain;
 		}
-		return 0;
 	}
 	else if(eff != AudioEffects::EFF_NONE) {
-
-		IVoiceCodec* codec = new SteamOpus::Opus_FrameDecoder();
-		codec->Init(5, 24000);
-		afflicted_players.emplace(id, std::make_tuple(codec, effs));
+		player.userid = id;
+		player.codec = g_eightbit->codecs.Acquire();
+		player.chain = chain;
 	}
+
+	ApplyEncoderSettings(player);
+
+	if (player.chain.NeedsState())
+		AllocEffectState(player);
+
 	return 0;
 }
 
@@ -257,6 +1295,28 @@ GMOD_MODULE_OPEN()
 	if (sv == nullptr){
 		Msg("sv is nullprt");
 	}
+
+	//Per-player state lives in a flat table indexed by player slot so the voice hook never has to hash anything.
+	g_eightbit->players.resize(sv != nullptr ? sv->GetMaxClients() : GMOD_MAX_PLAYERS);
+
+	//All decode/encode scratch memory comes from one arena, one block per slot, so speakers can be processed in parallel.
+	g_eightbit->scratch.Init(g_eightbit->players.size(), VOICE_SCRATCH_BLOCK);
+	for (size_t i = 0; i < g_eightbit->players.size(); i++) {
+		PlayerVoiceState& player = g_eightbit->players[i];
+		player.decompressBuf = g_eightbit->scratch.GetBlock(i);
+		player.recompressBuf = player.decompressBuf + VOICE_DECOMPRESS_SCRATCH;
+	}
+
+	//One codec per slot up front, so toggling effects on a full server never creates Opus state.
+	g_eightbit->codecs.Init(g_eightbit->players.size());
+
+	//Always on. Each slot's histograms are only written by the game thread and the worker the slot is pinned to.
+	g_eightbit->stats = new VoiceStats::PlayerStats[g_eightbit->players.size()];
+	for (size_t i = 0; i < g_eightbit->players.size(); i++) {
+		g_eightbit->players[i].stats = &g_eightbit->stats[i];
+	}
+	g_eightbit->clock.Start();
+	g_eightbit->statsWindowStart = std::chrono::steady_clock::now();
 	
 	SourceSDK::ModuleLoader engine_loader("engine");
 	SymbolFinder symfinder;
@@ -313,6 +1373,146 @@ GMOD_MODULE_OPEN()
 		LUA->PushCFunction(eightbit_setbroadcastport);
 		LUA->SetTable(-3);
 
+		LUA->PushString("AddRelayTarget");
+		LUA->PushCFunction(eightbit_addrelaytarget);
+		LUA->SetTable(-3);
+
+		LUA->PushString("ClearRelayTargets");
+		LUA->PushCFunction(eightbit_clearrelaytargets);
+		LUA->SetTable(-3);
+
+		LUA->PushString("StartCapture");
+		LUA->PushCFunction(eightbit_startcapture);
+		LUA->SetTable(-3);
+
+		LUA->PushString("StopCapture");
+		LUA->PushCFunction(eightbit_stopcapture);
+		LUA->SetTable(-3);
+
+		LUA->PushString("BenchmarkFanout");
+		LUA->PushCFunction(eightbit_benchmarkfanout);
+		LUA->SetTable(-3);
+
+		LUA->PushString("EnablePcmTap");
+		LUA->PushCFunction(eightbit_enablepcmtap);
+		LUA->SetTable(-3);
+
+		LUA->PushString("DisablePcmTap");
+		LUA->PushCFunction(eightbit_disablepcmtap);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetAsyncWorkers");
+		LUA->PushCFunction(eightbit_setasyncworkers);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetAsyncMaxLatency");
+		LUA->PushCFunction(eightbit_setasyncmaxlatency);
+		LUA->SetTable(-3);
+
+		LUA->PushString("GetAsyncStats");
+		LUA->PushCFunction(eightbit_getasyncstats);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetRelayMask");
+		LUA->PushCFunction(eightbit_setrelaymask);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetRelayPlayer");
+		LUA->PushCFunction(eightbit_setrelayplayer);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetRelayFormat");
+		LUA->PushCFunction(eightbit_setrelayformat);
+		LUA->SetTable(-3);
+
+		LUA->PushString("StartInject");
+		LUA->PushCFunction(eightbit_startinject);
+		LUA->SetTable(-3);
+
+		LUA->PushString("StopInject");
+		LUA->PushCFunction(eightbit_stopinject);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetInjectStream");
+		LUA->PushCFunction(eightbit_setinjectstream);
+		LUA->SetTable(-3);
+
+		LUA->PushString("GetInjectStats");
+		LUA->PushCFunction(eightbit_getinjectstats);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetRelayTransport");
+		LUA->PushCFunction(eightbit_setrelaytransport);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetRelayMixdown");
+		LUA->PushCFunction(eightbit_setrelaymixdown);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetRelayDropPolicy");
+		LUA->PushCFunction(eightbit_setrelaydroppolicy);
+		LUA->SetTable(-3);
+
+		LUA->PushString("GetRelayStats");
+		LUA->PushCFunction(eightbit_getrelaystats);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetEncoderSettings");
+		LUA->PushCFunction(eightbit_setencodersettings);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetPlayerEncoderSettings");
+		LUA->PushCFunction(eightbit_setplayerencodersettings);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetEncodeBudget");
+		LUA->PushCFunction(eightbit_setencodebudget);
+		LUA->SetTable(-3);
+
+		LUA->PushString("GetEncodeBudget");
+		LUA->PushCFunction(eightbit_getencodebudget);
+		LUA->SetTable(-3);
+
+		LUA->PushString("SetCodecIdleTimeout");
+		LUA->PushCFunction(eightbit_setcodecidletimeout);
+		LUA->SetTable(-3);
+
+		LUA->PushString("GetCodecPoolStats");
+		LUA->PushCFunction(eightbit_getcodecpoolstats);
+		LUA->SetTable(-3);
+
+		LUA->PushString("GetStats");
+		LUA->PushCFunction(eightbit_getstats);
+		LUA->SetTable(-3);
+
+		LUA->PushString("RELAY_FORMAT_RAW");
+		LUA->PushNumber(RELAY_FORMAT_RAW);
+		LUA->SetTable(-3);
+
+		LUA->PushString("RELAY_FORMAT_FRAMED");
+		LUA->PushNumber(RELAY_FORMAT_FRAMED);
+		LUA->SetTable(-3);
+
+		LUA->PushString("RELAY_TRANSPORT_UDP");
+		LUA->PushNumber(RELAY_TRANSPORT_UDP);
+		LUA->SetTable(-3);
+
+		LUA->PushString("RELAY_TRANSPORT_SHM");
+		LUA->PushNumber(RELAY_TRANSPORT_SHM);
+		LUA->SetTable(-3);
+
+		LUA->PushString("RELAY_TRANSPORT_TCP");
+		LUA->PushNumber(RELAY_TRANSPORT_TCP);
+		LUA->SetTable(-3);
+
+		LUA->PushString("RELAY_DROP_NEWEST");
+		LUA->PushNumber(Net::DROP_NEWEST);
+		LUA->SetTable(-3);
+
+		LUA->PushString("RELAY_DROP_OLDEST");
+		LUA->PushNumber(Net::DROP_OLDEST);
+		LUA->SetTable(-3);
+
 		LUA->PushString("EFF_NONE");
 		LUA->PushNumber(AudioEffects::EFF_NONE);
 		LUA->SetTable(-3);
@@ -359,7 +1559,24 @@ GMOD_MODULE_OPEN()
 	LUA->SetTable(-3);
 	LUA->Pop();
 
+	//Per-frame work (async voice fan-out) hangs off the Think hook.
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+	LUA->GetField(-1, "hook");
+	LUA->GetField(-1, "Add");
+	LUA->PushString("Think");
+	LUA->PushString("eightbit");
+	LUA->PushCFunction(eightbit_think);
+	LUA->Call(3, 0);
+	LUA->Pop(2);
+
 	net_handl = new Net();
+	net_handl->SetPrimaryTarget(g_eightbit->ip.c_str(), g_eightbit->port);
+	g_capture = new VoiceCapture();
+	g_injector = new VoiceInjector();
+	for (int i = 0; i < INJECT_MAX_STREAMS; i++) {
+		injectUserids[i] = -1;
+		injectSlots[i] = -1;
+	}
 
 #ifdef THIRDPARTY_LINK
 	linkMutedFunc();
@@ -372,13 +1589,21 @@ GMOD_MODULE_CLOSE()
 {
 	detour_BroadcastVoiceData.Destroy();
 
-	for (auto& p : g_eightbit->afflictedPlayers) {
-		IVoiceCodec* codec = std::get<0>(p.second);
-		if (codec != nullptr) {
-			delete codec;
-		}
+	delete g_pipeline;
+	g_pipeline = nullptr;
+
+	//Codecs belong to g_eightbit->codecs and go with it.
+	for (auto& p : g_eightbit->players) {
+		FreeEffectState(p);
+		delete p.tap;
 	}
 
+	delete[] g_eightbit->stats;
+	delete g_capture;
+	delete g_injector;
+	delete g_mixer;
+	FinishRelayDatagram();
+	delete g_shmRelay;
 	delete net_handl;
 	delete g_eightbit;
 
@@ -0,0 +1,177 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef __linux
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+	Close();
+}
+
+#ifdef _WIN32
+bool MappedFile::Create(const char* path, uint64_t size) {
+	Close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+
+	void* data = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+	if (data == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	m_file = file;
+	m_mapping = mapping;
+	m_data = (char*)data;
+	m_size = size;
+	m_writable = true;
+	return true;
+}
+
+bool MappedFile::Open(const char* path) {
+	Close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	m_file = file;
+	m_mapping = mapping;
+	m_data = (char*)data;
+	m_size = (uint64_t)size.QuadPart;
+	m_writable = false;
+	return true;
+}
+
+void MappedFile::Close(uint64_t truncateTo) {
+	if (m_data == nullptr)
+		return;
+
+	UnmapViewOfFile(m_data);
+	CloseHandle((HANDLE)m_mapping);
+
+	if (m_writable && truncateTo != 0 && truncateTo < m_size) {
+		LARGE_INTEGER pos;
+		pos.QuadPart = (LONGLONG)truncateTo;
+		SetFilePointerEx((HANDLE)m_file, pos, nullptr, FILE_BEGIN);
+		SetEndOfFile((HANDLE)m_file);
+	}
+
+	CloseHandle((HANDLE)m_file);
+	m_file = nullptr;
+	m_mapping = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+void MappedFile::FlushAsync() {
+	if (m_data != nullptr && m_writable)
+		FlushViewOfFile(m_data, 0);
+}
+#elif __linux
+bool MappedFile::Create(const char* path, uint64_t size) {
+	Close();
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	if (ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	m_fd = fd;
+	m_data = (char*)data;
+	m_size = size;
+	m_writable = true;
+	return true;
+}
+
+bool MappedFile::Open(const char* path) {
+	Close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	m_fd = fd;
+	m_data = (char*)data;
+	m_size = (uint64_t)st.st_size;
+	m_writable = false;
+	return true;
+}
+
+void MappedFile::Close(uint64_t truncateTo) {
+	if (m_data == nullptr)
+		return;
+
+	munmap(m_data, m_size);
+
+	if (m_writable && truncateTo != 0 && truncateTo < m_size)
+		ftruncate(m_fd, (off_t)truncateTo);
+
+	close(m_fd);
+	m_fd = -1;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+void MappedFile::FlushAsync() {
+	if (m_data != nullptr && m_writable)
+		msync(m_data, m_size, MS_ASYNC);
+}
+#endif
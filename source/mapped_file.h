@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+
+//A file mapped into memory, read-write (Create) or read-only (Open).
+class MappedFile {
+private:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+public:
+	MappedFile() {}
+	~MappedFile();
+
+	//Creates (or truncates) path to size bytes and maps it read-write.
+	bool Create(const char* path, uint64_t size);
+	bool Open(const char* path);
+
+	//Unmaps the file. If truncateTo is non-zero a writable file is cut down to that many bytes first.
+	void Close(uint64_t truncateTo = 0);
+
+	//Asks the OS to start writing dirty pages back without waiting for it.
+	void FlushAsync();
+
+	char* Data() const { return m_data; }
+	uint64_t Size() const { return m_size; }
+	bool IsOpen() const { return m_data != nullptr; }
+
+private:
+	char* m_data = nullptr;
+	uint64_t m_size = 0;
+	bool m_writable = false;
+#ifdef _WIN32
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+#else
+	int m_fd = -1;
+#endif
+};
@@ -1,5 +1,7 @@
 #include "net.h"
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -9,9 +11,13 @@
 #ifdef __linux
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
 #endif
 
 Net::Net() {
@@ -22,28 +28,541 @@ Net::Net() {
 		throw "Initialization Error!";
 
 	m_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (m_socket == INVALID_SOCKET)
+	m_connectedSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_socket == INVALID_SOCKET || m_connectedSocket == INVALID_SOCKET)
 		throw "Invalid socket!";
 #elif __linux
 	m_socket = socket(AF_INET, SOCK_DGRAM, 0);
-	if (m_socket < 0)
+	m_connectedSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (m_socket < 0 || m_connectedSocket < 0)
 		throw "Invalid socket!";
 #endif
+
+	//Slot 0 is always the primary target.
+	m_targets[0] = Target();
+	m_targetCount = 1;
+
+	m_thread = std::thread(&Net::SenderLoop, this);
+}
+
+bool Net::Resolve(const char* dest, uint16_t port, Target& out) {
+	in_addr addr;
+	if (inet_pton(AF_INET, dest, &addr) != 1)
+		return false;
+
+	out.addr = addr.s_addr;
+	out.port = htons(port);
+	return true;
+}
+
+bool Net::SetPrimaryTarget(const char* dest, uint16_t port) {
+	Target target;
+	if (!Resolve(dest, port, target))
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_targetsMtx);
+	m_targets[0] = target;
+
+	sockaddr_in addr = sockaddr_in();
+	addr.sin_family = AF_INET;
+	addr.sin_port = target.port;
+	addr.sin_addr.s_addr = target.addr;
+	connect(m_connectedSocket, (sockaddr*)&addr, sizeof(addr));
+	return true;
+}
+
+bool Net::AddTarget(const char* dest, uint16_t port) {
+	Target target;
+	if (!Resolve(dest, port, target))
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_targetsMtx);
+	if (m_targetCount == NET_MAX_TARGETS)
+		return false;
+
+	m_targets[m_targetCount++] = target;
+	return true;
+}
+
+void Net::ClearExtraTargets() {
+	std::lock_guard<std::mutex> lock(m_targetsMtx);
+	m_targetCount = 1;
+}
+
+bool Net::SetTcpTarget(const char* dest, uint16_t port, uint32_t backlogBytes) {
+	Target target;
+	if (!Resolve(dest, port, target))
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_targetsMtx);
+		m_tcpTarget = target;
+	}
+	m_tcpBacklogSize.store(std::max<uint32_t>(backlogBytes, sizeof(uint32_t) + NET_MAX_DATAGRAM), std::memory_order_relaxed);
+	m_tcpGeneration.fetch_add(1, std::memory_order_release);
+	m_tcpEnabled.store(true, std::memory_order_release);
+	m_wake.notify_one();
+	return true;
+}
+
+void Net::DisableTcp() {
+	m_tcpEnabled.store(false, std::memory_order_release);
+	m_wake.notify_one();
+}
+
+char* Net::BeginPacket(uint32_t maxLen) {
+	if (maxLen > NET_MAX_DATAGRAM) {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	uint64_t dropped = 0;
+	m_pending = m_ring.BeginPush(m_policy.load(std::memory_order_relaxed) == DROP_OLDEST, dropped);
+	if (m_pending == nullptr)
+		dropped++;
+
+	if (dropped > 0)
+		m_dropped.fetch_add(dropped, std::memory_order_relaxed);
+
+	if (m_pending == nullptr)
+		return nullptr;
+
+	return m_pending->data;
+}
+
+void Net::CommitPacket(uint32_t len) {
+	m_pending->len = len;
+	m_ring.CommitPush();
+	m_pending = nullptr;
+	m_enqueued.fetch_add(1, std::memory_order_relaxed);
+
+	//Don't wait for the end of the frame if there's already a full batch.
+	if (m_ring.Size() >= NET_BATCH_MAX)
+		m_wake.notify_one();
+}
+
+void Net::Flush() {
+	m_wake.notify_one();
+}
+
+void Net::SenderLoop() {
+	while (m_running.load(std::memory_order_relaxed)) {
+		bool tcp = m_tcpEnabled.load(std::memory_order_acquire);
+
+		if (!tcp && (m_tcpSocket >= 0 || m_tcpBacklogRecords > 0)) {
+			CloseTcp();
+			m_dropped.fetch_add(m_tcpBacklogRecords, std::memory_order_relaxed);
+			ClearBacklog();
+		}
+
+		if ((tcp ? SendBatchTcp() : SendBatch()) > 0)
+			continue;
+
+		//Flush() doesn't take the lock, so a wakeup can be missed. The timeout bounds how long that can delay a packet.
+		std::unique_lock<std::mutex> lock(m_wakeMtx);
+		m_wake.wait_for(lock, std::chrono::milliseconds(5));
+	}
+
+	//Whatever was queued before shutdown still goes out. Over TCP only to a consumer that's still connected, for
+	//NET_TCP_SHUTDOWN_MS at most: a stalled one mustn't hold up unloading.
+	if (m_tcpEnabled.load(std::memory_order_acquire)) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(NET_TCP_SHUTDOWN_MS);
+		while (m_tcpSocket >= 0 && std::chrono::steady_clock::now() < deadline) {
+			SendBatchTcp();
+			if (m_tcpBacklogRecords == 0 && m_ring.Size() == 0)
+				break;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	else
+		while (SendBatch() > 0) {}
+}
+
+int Net::SendBatch() {
+	//The datagrams are sent from where the game thread wrote them, the ring keeps them claimed until the sends are done.
+	Datagram* batch[NET_BATCH_MAX];
+	int count = (int)m_ring.Claim(NET_BATCH_MAX, batch);
+	if (count == 0)
+		return 0;
+
+	{
+		//Every target is sent the same batch, nothing is copied per target.
+		std::lock_guard<std::mutex> lock(m_targetsMtx);
+		if (m_targetCount == 1) {
+			SendTo(m_connectedSocket, nullptr, batch, count);
+		}
+		else {
+			for (int i = 0; i < m_targetCount; i++) {
+				SendTo(m_socket, &m_targets[i], batch, count);
+			}
+		}
+	}
+	m_ring.Release();
+
+	m_sent.fetch_add(count, std::memory_order_relaxed);
+	m_batches.fetch_add(1, std::memory_order_relaxed);
+	if (count > m_largestBatch.load(std::memory_order_relaxed))
+		m_largestBatch.store(count, std::memory_order_relaxed);
+
+	return count;
+}
+
+//Sends a batch to one target, or through the connected socket if target is null.
+void Net::SendTo(int sock, const Target* target, Datagram* const* batch, int count) {
+	sockaddr_in addr = sockaddr_in();
+	if (target != nullptr) {
+		addr.sin_family = AF_INET;
+		addr.sin_port = target->port;
+		addr.sin_addr.s_addr = target->addr;
+	}
+
+#ifdef _WIN32
+	for (int i = 0; i < count; i++) {
+		if (target != nullptr)
+			sendto(sock, batch[i]->data, batch[i]->len, 0, (sockaddr*)&addr, sizeof(addr));
+		else
+			send(sock, batch[i]->data, batch[i]->len, 0);
+	}
+#elif __linux
+	iovec iovs[NET_BATCH_MAX];
+	mmsghdr msgs[NET_BATCH_MAX];
+	for (int i = 0; i < count; i++) {
+		iovs[i].iov_base = batch[i]->data;
+		iovs[i].iov_len = batch[i]->len;
+
+		msgs[i] = mmsghdr();
+		msgs[i].msg_hdr.msg_name = target != nullptr ? &addr : nullptr;
+		msgs[i].msg_hdr.msg_namelen = target != nullptr ? sizeof(addr) : 0;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	//sendmmsg stops at the first datagram that fails, skip it and carry on with the rest like individual sends would.
+	int sent = 0;
+	while (sent < count) {
+		int res = sendmmsg(sock, msgs + sent, count - sent, 0);
+		sent += res > 0 ? res : 1;
+	}
+#endif
 }
 
-void Net::SendPacket(const char* dest, uint16_t port, const char* buffer, uint32_t len) {
-	sockaddr_in dest_str;
-	dest_str.sin_family = AF_INET;
-	dest_str.sin_port = htons(port);
-	inet_pton(AF_INET, dest, &dest_str.sin_addr);
-	sendto(m_socket, buffer, len, 0, (sockaddr*)&dest_str, sizeof(dest_str));
+int Net::SendBatchTcp() {
+	size_t backlogSize = m_tcpBacklogSize.load(std::memory_order_relaxed);
+	if (backlogSize != m_tcpBacklog.size())
+		ResizeBacklog(backlogSize);
+
+	//Out of the ring right away, so a reconnect is covered by the backlog rather than the ring's few hundred entries.
+	Datagram* claimed[NET_BATCH_MAX];
+	while (size_t count = m_ring.Claim(NET_BATCH_MAX, claimed)) {
+		for (size_t i = 0; i < count; i++) {
+			PushBacklog(claimed[i]);
+		}
+		m_ring.Release();
+	}
+	m_tcpBacklogBytes.store(m_tcpBacklogTail - m_tcpBacklogHead, std::memory_order_relaxed);
+
+	if (!EnsureTcpConnected())
+		return 0;
+
+	if (m_tcpBacklogRecords == 0) {
+		//Nothing owed, the consumer can't be behind.
+		m_tcpLastProgress = std::chrono::steady_clock::now();
+		return 0;
+	}
+
+	int64_t written = WriteBacklog();
+	if (written < 0) {
+		CloseTcp();
+		return 0;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (written == 0) {
+		//The consumer stopped reading. The record it got part of is sent again in full on the next connection.
+		if (now - m_tcpLastProgress > std::chrono::milliseconds(NET_TCP_TIMEOUT_MS))
+			CloseTcp();
+		return 0;
+	}
+	m_tcpLastProgress = now;
+
+	//Only whole records count as sent, the rest of a partly written one goes out next time.
+	m_tcpBacklogWritten += written;
+	int records = 0;
+	while (m_tcpBacklogHead < m_tcpBacklogTail) {
+		uint32_t size = BacklogRecordSize(m_tcpBacklogHead);
+		if (size > m_tcpBacklogWritten)
+			break;
+
+		m_tcpBacklogHead += size;
+		m_tcpBacklogWritten -= size;
+		m_tcpBacklogRecords--;
+		records++;
+	}
+	if (m_tcpBacklogRecords == 0) {
+		ClearBacklog();
+		m_tcpBackoffMs = 0;
+	}
+	m_tcpBacklogBytes.store(m_tcpBacklogTail - m_tcpBacklogHead, std::memory_order_relaxed);
+	m_sent.fetch_add(records, std::memory_order_relaxed);
+
+	m_batches.fetch_add(1, std::memory_order_relaxed);
+	if (records > m_largestBatch.load(std::memory_order_relaxed))
+		m_largestBatch.store(records, std::memory_order_relaxed);
+
+	return records;
+}
+
+void Net::ResizeBacklog(size_t capacity) {
+	//Part of a record may be on the wire, the stream can't carry on without the rest of it.
+	if (m_tcpBacklogWritten > 0)
+		CloseTcp();
+
+	m_dropped.fetch_add(m_tcpBacklogRecords, std::memory_order_relaxed);
+	m_tcpBacklogDropped.fetch_add(m_tcpBacklogRecords, std::memory_order_relaxed);
+	ClearBacklog();
+
+	//Sender thread, the game thread never waits on this.
+	std::vector<char>(capacity).swap(m_tcpBacklog);
+}
+
+void Net::ClearBacklog() {
+	m_tcpBacklogHead = 0;
+	m_tcpBacklogTail = 0;
+	m_tcpBacklogRecords = 0;
+	m_tcpBacklogWritten = 0;
+	m_tcpBacklogBytes.store(0, std::memory_order_relaxed);
+}
+
+bool Net::PushBacklog(const Datagram* datagram) {
+	uint32_t len = datagram->len;
+	size_t size = sizeof(uint32_t) + len;
+	if (size > m_tcpBacklog.size()) {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		m_tcpBacklogDropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	while (m_tcpBacklogTail - m_tcpBacklogHead + size > m_tcpBacklog.size()) {
+		//The oldest record is partly on the wire already, taking it out would break the stream. The new one goes instead.
+		if (m_tcpBacklogWritten > 0) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			m_tcpBacklogDropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		DropOldestBacklogRecord();
+	}
+
+	char prefix[4] = { (char)len, (char)(len >> 8), (char)(len >> 16), (char)(len >> 24) };
+	CopyToBacklog(m_tcpBacklogTail, prefix, sizeof(prefix));
+	CopyToBacklog(m_tcpBacklogTail + sizeof(prefix), datagram->data, len);
+	m_tcpBacklogTail += size;
+	m_tcpBacklogRecords++;
+	return true;
+}
+
+void Net::DropOldestBacklogRecord() {
+	m_tcpBacklogHead += BacklogRecordSize(m_tcpBacklogHead);
+	m_tcpBacklogRecords--;
+	m_dropped.fetch_add(1, std::memory_order_relaxed);
+	m_tcpBacklogDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint32_t Net::BacklogRecordSize(uint64_t pos) const {
+	size_t capacity = m_tcpBacklog.size();
+	uint32_t len = 0;
+	for (int i = 0; i < 4; i++) {
+		len |= (uint32_t)(unsigned char)m_tcpBacklog[(size_t)((pos + i) % capacity)] << (i * 8);
+	}
+	return (uint32_t)sizeof(uint32_t) + len;
+}
+
+void Net::CopyToBacklog(uint64_t pos, const char* src, size_t len) {
+	size_t capacity = m_tcpBacklog.size();
+	size_t offset = (size_t)(pos % capacity);
+	size_t first = std::min(len, capacity - offset);
+	std::memcpy(m_tcpBacklog.data() + offset, src, first);
+	std::memcpy(m_tcpBacklog.data(), src + first, len - first);
+}
+
+//Connects to addr:port (network byte order) within NET_TCP_TIMEOUT_MS. Returns the socket or -1.
+static int ConnectTcp(uint32_t addr, uint16_t port) {
+	sockaddr_in sa = sockaddr_in();
+	sa.sin_family = AF_INET;
+	sa.sin_port = port;
+	sa.sin_addr.s_addr = addr;
+
+#ifdef _WIN32
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == INVALID_SOCKET)
+		return -1;
+
+	u_long nonBlocking = 1;
+	ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+	int res = connect(sock, (sockaddr*)&sa, sizeof(sa));
+	if (res == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+		WSAPOLLFD pfd = { sock, POLLWRNORM, 0 };
+		if (WSAPoll(&pfd, 1, NET_TCP_TIMEOUT_MS) == 1 && (pfd.revents & (POLLERR | POLLHUP)) == 0)
+			res = 0;
+	}
+
+	if (res != 0) {
+		closesocket(sock);
+		return -1;
+	}
+
+	//Left non-blocking, the sender only ever writes what the socket takes.
+	BOOL noDelay = TRUE;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	return (int)sock;
+#elif __linux
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+	int res = connect(sock, (sockaddr*)&sa, sizeof(sa));
+	if (res < 0 && errno == EINPROGRESS) {
+		pollfd pfd = { sock, POLLOUT, 0 };
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (poll(&pfd, 1, NET_TCP_TIMEOUT_MS) == 1 && getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+			res = 0;
+	}
+
+	if (res != 0) {
+		close(sock);
+		return -1;
+	}
+
+	//Left non-blocking, the sender only ever writes what the socket takes.
+	//Batches are already coalesced, Nagle would only hold them back.
+	int noDelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	return sock;
+#endif
+}
+
+bool Net::EnsureTcpConnected() {
+	uint32_t generation = m_tcpGeneration.load(std::memory_order_acquire);
+	if (generation != m_tcpSocketGeneration) {
+		CloseTcp();
+		m_tcpSocketGeneration = generation;
+		m_tcpBackoffMs = 0;
+		m_tcpNextAttempt = std::chrono::steady_clock::now();
+	}
+
+	if (m_tcpSocket >= 0)
+		return true;
+
+	auto now = std::chrono::steady_clock::now();
+	if (now < m_tcpNextAttempt)
+		return false;
+
+	Target target;
+	{
+		std::lock_guard<std::mutex> lock(m_targetsMtx);
+		target = m_tcpTarget;
+	}
+
+	//Backs off until a batch has been written in full, so a consumer that accepts and then drops us isn't hammered.
+	m_tcpBackoffMs = m_tcpBackoffMs == 0 ? NET_TCP_BACKOFF_MIN_MS : std::min(m_tcpBackoffMs * 2, NET_TCP_BACKOFF_MAX_MS);
+	m_tcpNextAttempt = now + std::chrono::milliseconds(m_tcpBackoffMs);
+
+	m_tcpSocket = ConnectTcp(target.addr, target.port);
+	if (m_tcpSocket < 0)
+		return false;
+
+	m_tcpLastProgress = now;
+	m_tcpConnected.store(true, std::memory_order_relaxed);
+	m_tcpConnects.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void Net::CloseTcp() {
+	if (m_tcpSocket < 0)
+		return;
+
+#ifdef _WIN32
+	closesocket(m_tcpSocket);
+#elif __linux
+	close(m_tcpSocket);
+#endif
+	m_tcpSocket = -1;
+	m_tcpBacklogWritten = 0;
+	m_tcpConnected.store(false, std::memory_order_relaxed);
+}
+
+int64_t Net::WriteBacklog() {
+	size_t capacity = m_tcpBacklog.size();
+	uint64_t total = m_tcpBacklogTail - m_tcpBacklogHead;
+	uint64_t written = m_tcpBacklogWritten;
+
+	while (written < total) {
+		//At most two runs, the ring may wrap.
+		size_t offset = (size_t)((m_tcpBacklogHead + written) % capacity);
+		size_t remaining = (size_t)(total - written);
+		size_t first = std::min(remaining, capacity - offset);
+		char* bufs[2] = { m_tcpBacklog.data() + offset, m_tcpBacklog.data() };
+		size_t lens[2] = { first, remaining - first };
+		int count = lens[1] > 0 ? 2 : 1;
+
+		long res;
+#ifdef _WIN32
+		WSABUF wsaBufs[2];
+		for (int i = 0; i < count; i++) {
+			wsaBufs[i].buf = bufs[i];
+			wsaBufs[i].len = (ULONG)lens[i];
+		}
+
+		DWORD sent = 0;
+		res = WSASend(m_tcpSocket, wsaBufs, count, &sent, 0, nullptr, nullptr) == 0 ? (long)sent : -1;
+		if (res < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+			break;
+#elif __linux
+		iovec iovs[2];
+		for (int i = 0; i < count; i++) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = lens[i];
+		}
+
+		//sendmsg rather than writev for MSG_NOSIGNAL, a dead consumer mustn't SIGPIPE the server.
+		msghdr msg = msghdr();
+		msg.msg_iov = iovs;
+		msg.msg_iovlen = count;
+		res = sendmsg(m_tcpSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+#endif
+		if (res <= 0)
+			return -1;
+
+		written += res;
+	}
+
+	return (int64_t)(written - m_tcpBacklogWritten);
 }
 
 Net::~Net() {
+	m_running.store(false);
+	m_wake.notify_one();
+	if (m_thread.joinable())
+		m_thread.join();
+
+	CloseTcp();
+
 #ifdef _WIN32
 	closesocket(m_socket);
+	closesocket(m_connectedSocket);
 	WSACleanup();
 #elif __linux
 	close(m_socket);
+	close(m_connectedSocket);
 #endif
-}
\ No newline at end of file
+}
@@ -1,12 +1,196 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "spsc_ring.h"
 
+//Datagrams sent per sendmmsg.
+#define NET_BATCH_MAX 64
+//Largest datagram the relay carries, comfortably above any voice packet.
+#define NET_MAX_DATAGRAM 4096
+//Datagrams that can wait for the sender thread before the drop policy kicks in.
+#define NET_QUEUE_DEPTH 256
+//Relay consumers every packet goes to, including the primary broadcast target.
+#define NET_MAX_TARGETS 8
+//TCP relay: how long a connection attempt, or a consumer that takes nothing, may take before the connection is given up on.
+#define NET_TCP_TIMEOUT_MS 2000
+//TCP relay: reconnect attempts back off exponentially between these.
+#define NET_TCP_BACKOFF_MIN_MS 100
+#define NET_TCP_BACKOFF_MAX_MS 5000
+//TCP relay: bytes of records kept while the connection is down, unless SetTcpTarget is given a size.
+#define NET_TCP_BACKLOG_DEFAULT (4 * 1024 * 1024)
+//TCP relay: how long shutdown keeps writing the backlog to a consumer that's slow to take it.
+#define NET_TCP_SHUTDOWN_MS 500
+
+//Relays datagrams to a set of UDP targets from a dedicated sender thread.
+//The game thread builds packets in place in a preallocated ring and never blocks. The sender thread drains the ring
+//in batches, with one sendmmsg per target on Linux.
+//
+//In TCP mode the same packets go over one connection instead, as records of a little endian uint32 length followed by
+//the packet. The sender thread moves them out of the ring into a backlog of its own as soon as they're queued, and
+//writes as much of the backlog as the socket takes without blocking, so a slow consumer never backs up the ring. It
+//connects and reconnects with backoff. While disconnected the backlog is the window kept for the reconnect: it's sized
+//in bytes, and once it's full the oldest records make room.
 class Net {
 public:
+	enum DropPolicy {
+		DROP_NEWEST,
+		DROP_OLDEST
+	};
+
 	Net();
 	~Net();
-	void SendPacket(const char* dest, uint16_t port, const char* buffer, uint32_t len);
+
+	//The target set through SetBroadcastIP/SetBroadcastPort. Returns false, keeping the old target, if dest isn't a valid IPv4 address.
+	bool SetPrimaryTarget(const char* dest, uint16_t port);
+
+	//Extra targets that get a copy of every relayed packet. Returns false if dest is invalid or the list is full.
+	bool AddTarget(const char* dest, uint16_t port);
+	void ClearExtraTargets();
+
+	//Switches to TCP mode, sending to dest:port instead of the UDP targets, with a backlog of backlogBytes for reconnects.
+	//Changing the backlog's size drops what's in it. Returns false if dest is invalid.
+	bool SetTcpTarget(const char* dest, uint16_t port, uint32_t backlogBytes = NET_TCP_BACKLOG_DEFAULT);
+	//Back to the UDP targets. The backlog is dropped.
+	void DisableTcp();
+
+	bool IsTcpConnected() const {
+		return m_tcpConnected.load(std::memory_order_relaxed);
+	}
+
+	//Connections established in TCP mode, the first one included.
+	uint64_t GetTcpConnectCount() const {
+		return m_tcpConnects.load(std::memory_order_relaxed);
+	}
+
+	//Bytes waiting in the TCP backlog.
+	uint64_t GetTcpBacklogBytes() const {
+		return m_tcpBacklogBytes.load(std::memory_order_relaxed);
+	}
+
+	//Records the TCP backlog had to drop, also counted in GetDroppedCount.
+	uint64_t GetTcpBacklogDroppedCount() const {
+		return m_tcpBacklogDropped.load(std::memory_order_relaxed);
+	}
+
+	//Game thread. Reserves up to maxLen bytes for a datagram, the caller fills them in and calls CommitPacket with the
+	//length actually used. Returns nullptr if the packet is dropped: it's too large, or the ring is full under DROP_NEWEST.
+	char* BeginPacket(uint32_t maxLen);
+	void CommitPacket(uint32_t len);
+
+	//Game thread. Wakes the sender for whatever was queued this frame.
+	void Flush();
+
+	void SetDropPolicy(DropPolicy policy) {
+		m_policy.store(policy, std::memory_order_relaxed);
+	}
+
+	uint64_t GetEnqueuedCount() const {
+		return m_enqueued.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetSentCount() const {
+		return m_sent.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetDroppedCount() const {
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetBatchCount() const {
+		return m_batches.load(std::memory_order_relaxed);
+	}
+
+	int GetLargestBatch() const {
+		return m_largestBatch.load(std::memory_order_relaxed);
+	}
 
 private:
+	struct Target {
+		//Both in network byte order.
+		uint32_t addr;
+		uint16_t port;
+	};
+
+	struct Datagram {
+		uint32_t len;
+		char data[NET_MAX_DATAGRAM];
+	};
+
+	static bool Resolve(const char* dest, uint16_t port, Target& out);
+	void SenderLoop();
+	//Sender thread. Sends up to NET_BATCH_MAX datagrams straight out of the ring, returns how many.
+	int SendBatch();
+	void SendTo(int sock, const Target* target, Datagram* const* batch, int count);
+
+	//Sender thread, TCP mode. Moves the ring into the backlog and writes what the socket takes, returns how many records
+	//went out in full. A record that only went out in part is sent again in full if the connection is lost.
+	int SendBatchTcp();
+	bool EnsureTcpConnected();
+	void CloseTcp();
+
+	//Sender thread. The backlog is a byte ring of records, m_tcpBacklogHead and m_tcpBacklogTail count bytes since it
+	//was last emptied.
+	void ResizeBacklog(size_t capacity);
+	void ClearBacklog();
+	bool PushBacklog(const Datagram* datagram);
+	void DropOldestBacklogRecord();
+	//Full size of the record at pos, prefix included.
+	uint32_t BacklogRecordSize(uint64_t pos) const;
+	void CopyToBacklog(uint64_t pos, const char* src, size_t len);
+	//Writes the backlog past m_tcpBacklogWritten without blocking. Returns how many bytes went out, -1 if the connection
+	//is gone.
+	int64_t WriteBacklog();
+
 	int m_socket;
-};
\ No newline at end of file
+	//Connected to the primary target, used when it's the only one so the kernel skips the per-datagram route lookup.
+	int m_connectedSocket;
+
+	//Only changed from the game thread, under the lock, the sender holds it while sending.
+	std::mutex m_targetsMtx;
+	Target m_targets[NET_MAX_TARGETS];
+	int m_targetCount = 0;
+
+	SpscDropRing<Datagram> m_ring{NET_QUEUE_DEPTH};
+	Datagram* m_pending = nullptr;
+	std::atomic<int> m_policy{DROP_OLDEST};
+
+	//Set from the game thread under m_targetsMtx, every change bumps the generation so the sender reconnects.
+	Target m_tcpTarget;
+	std::atomic<bool> m_tcpEnabled{false};
+	std::atomic<uint32_t> m_tcpGeneration{0};
+	std::atomic<bool> m_tcpConnected{false};
+
+	std::atomic<uint32_t> m_tcpBacklogSize{NET_TCP_BACKLOG_DEFAULT};
+
+	//Sender thread only.
+	int m_tcpSocket = -1;
+	uint32_t m_tcpSocketGeneration = 0;
+	int m_tcpBackoffMs = 0;
+	std::chrono::steady_clock::time_point m_tcpNextAttempt;
+	std::vector<char> m_tcpBacklog;
+	uint64_t m_tcpBacklogHead = 0;
+	uint64_t m_tcpBacklogTail = 0;
+	uint64_t m_tcpBacklogRecords = 0;
+	//Bytes past the head already written to the current connection, only ever part of the head record.
+	uint64_t m_tcpBacklogWritten = 0;
+	std::chrono::steady_clock::time_point m_tcpLastProgress;
+
+	std::thread m_thread;
+	std::mutex m_wakeMtx;
+	std::condition_variable m_wake;
+	std::atomic<bool> m_running{true};
+
+	std::atomic<uint64_t> m_enqueued{0};
+	std::atomic<uint64_t> m_sent{0};
+	std::atomic<uint64_t> m_dropped{0};
+	std::atomic<uint64_t> m_batches{0};
+	std::atomic<int> m_largestBatch{0};
+	std::atomic<uint64_t> m_tcpConnects{0};
+	std::atomic<uint64_t> m_tcpBacklogBytes{0};
+	std::atomic<uint64_t> m_tcpBacklogDropped{0};
+};
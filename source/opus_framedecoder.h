@@ -1,10 +1,11 @@
 #pragma once
 #include "opus.h"
 #include "ivoicecodec.h"
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <algorithm>
-#include <deque>
-#include <vector>
+#include <cstring>
 
 namespace SteamOpus {
 
@@ -35,11 +36,17 @@ namespace SteamOpus {
         Opus_FrameDecoder& operator=(const Opus_FrameDecoder&) = delete;
 
     public:
-        Opus_FrameDecoder() {
-            int error = 0;
+        // The decoder and encoder are only created once the codec first decodes or encodes, so a codec that only
+        // ever does one of them never pays for the other
+        Opus_FrameDecoder() {}
+
+        // Places the decoder and encoder in caller owned memory instead, StateSize() bytes starting on a cache line.
+        // They're still set up on first use, with opus_*_init in place. The memory has to outlive the codec
+        explicit Opus_FrameDecoder(char* state) : m_state(state) {}
 
-            dec = opus_decoder_create(SAMPLERATE_GMOD_OPUS, 1, &error);
-            enc = opus_encoder_create(SAMPLERATE_GMOD_OPUS, 1, OPUS_APPLICATION_VOIP, &error);
+        // Bytes the in place constructor needs: the decoder state, then the encoder state, each on its own cache lines
+        static size_t StateSize() {
+            return AlignState(opus_decoder_get_size(1)) + AlignState(opus_encoder_get_size(1));
         }
 
         virtual bool Init(int quality, int sampleRate) {
@@ -51,61 +58,102 @@ namespace SteamOpus {
         }
 
         virtual bool ResetState() {
-            opus_decoder_ctl(dec, OPUS_RESET_STATE);
-            opus_encoder_ctl(enc, OPUS_RESET_STATE);
+            if (dec)
+                opus_decoder_ctl(dec, OPUS_RESET_STATE);
+            if (enc)
+                opus_encoder_ctl(enc, OPUS_RESET_STATE);
+            m_seq = 0;
+            m_encodeSeq = 0;
+            m_frameFill = 0;
             return true;
         }
 
+        // Drops the decoder and encoder: heap ones are destroyed, in place ones are only marked unused. The codec
+        // carries on as if ResetState had been called, they're set up again fresh on next use
+        void ReleaseState() {
+            if (dec && !m_state)
+                opus_decoder_destroy(dec);
+            if (enc && !m_state)
+                opus_encoder_destroy(enc);
+
+            dec = nullptr;
+            enc = nullptr;
+            m_hasDecoder.store(false, std::memory_order_relaxed);
+            m_hasEncoder.store(false, std::memory_order_relaxed);
+            ResetState();
+        }
+
+        bool HasState() const {
+            return dec != nullptr || enc != nullptr;
+        }
+
+        // Whether the decoder or encoder is set up right now, safe to ask from any thread
+        bool HasDecoder() const {
+            return m_hasDecoder.load(std::memory_order_relaxed);
+        }
+
+        bool HasEncoder() const {
+            return m_hasEncoder.load(std::memory_order_relaxed);
+        }
+
+        // Encoder complexity (0-10), bitrate in bits/s and VBR on/off, -1 for the library default of each.
+        // Can be called while another thread is encoding, the encoder picks them up before its next frame.
+        void SetEncoderSettings(int complexity, int bitrate, int vbr) {
+            m_complexity.store(complexity, std::memory_order_relaxed);
+            m_bitrate.store(bitrate, std::memory_order_relaxed);
+            m_vbr.store(vbr, std::memory_order_relaxed);
+            m_settingsChanged.store(true, std::memory_order_release);
+        }
+
         virtual void Release() {}
 
         virtual int	Compress(const char* pUncompressed, int nSamples, char* pCompressed, int maxCompressedBytes, bool bFinal) {
             if (!nSamples) return 0;
+            if (!enc && !CreateEncoder()) return -1;
+            if (m_settingsChanged.exchange(false, std::memory_order_acquire)) ApplyEncoderSettings();
 
             const char* const pCompressedBase = pCompressed;
             char* pCompressedEnd = pCompressed + maxCompressedBytes;
-
-            if (sample_buf.size() + nSamples < FRAME_SIZE_GMOD && !bFinal) {
-                sample_buf.insert(sample_buf.end(), (const uint16_t*)pUncompressed, (const uint16_t*)pUncompressed + nSamples);
-                return 0;
-            }
-
-            std::vector<uint16_t> temp_buf(sample_buf.begin(), sample_buf.end());
-            sample_buf.clear();
-
-            uint32_t remainder = (temp_buf.size() + nSamples) % FRAME_SIZE_GMOD;
-            temp_buf.insert(temp_buf.end(), (const uint16_t*)pUncompressed, (const uint16_t*)pUncompressed + nSamples);
-
-            if (remainder) {
-                if (bFinal) {
-                    // if bFinal do not dump in queue and fill instead
-                    std::fill_n(std::back_inserter(temp_buf), FRAME_SIZE_GMOD - remainder, 0);
-                } else {
-                    // Dump left overs in queue
-                    sample_buf.insert(sample_buf.end(), temp_buf.end() - remainder, temp_buf.end());
-                    temp_buf.erase(temp_buf.end() - remainder, temp_buf.end());
+            const opus_int16* in = (const opus_int16*)pUncompressed;
+
+            // Top up the frame left over from the last call first
+            if (m_frameFill > 0) {
+                int take = std::min(nSamples, FRAME_SIZE_GMOD - m_frameFill);
+                std::memcpy(m_frameBuf + m_frameFill, in, take * sizeof(opus_int16));
+                m_frameFill += take;
+                in += take;
+                nSamples -= take;
+
+                if (m_frameFill < FRAME_SIZE_GMOD && !bFinal)
+                    return 0;
+
+                if (m_frameFill == FRAME_SIZE_GMOD) {
+                    m_frameFill = 0;
+                    if (!EncodeFrame(m_frameBuf, pCompressed, pCompressedEnd))
+                        return -1;
                 }
             }
 
-            for (uint32_t i = 0; i < temp_buf.size(); i += FRAME_SIZE_GMOD) {
-                uint16_t* chunk = temp_buf.data() + i;
-
-                if (pCompressed + sizeof(uint16_t) > pCompressedEnd)
-                    return -1;
-
-                uint16_t* chunk_len = (uint16_t*)pCompressed;
-                pCompressed += sizeof(uint16_t);
-
-                CHK_BUF_WRITE(pCompressed, pCompressedEnd, uint16_t, m_encodeSeq++);
-
-                int bytes_written = opus_encode(enc, (opus_int16*)chunk, FRAME_SIZE_GMOD, (unsigned char*)pCompressed, std::min<uint64_t>(0x7FFF, pCompressedEnd - pCompressed));
-                if (bytes_written < 0)
+            // Whole frames are encoded straight from the caller's buffer
+            for (; nSamples >= FRAME_SIZE_GMOD; in += FRAME_SIZE_GMOD, nSamples -= FRAME_SIZE_GMOD) {
+                if (!EncodeFrame(in, pCompressed, pCompressedEnd))
                     return -1;
+            }
 
-                *chunk_len = bytes_written;
-                pCompressed += bytes_written;
+            if (nSamples > 0) {
+                std::memcpy(m_frameBuf + m_frameFill, in, nSamples * sizeof(opus_int16));
+                m_frameFill += nSamples;
             }
 
             if (bFinal) {
+                // if bFinal do not keep the left overs and pad them out instead
+                if (m_frameFill > 0) {
+                    std::fill(m_frameBuf + m_frameFill, m_frameBuf + FRAME_SIZE_GMOD, 0);
+                    m_frameFill = 0;
+                    if (!EncodeFrame(m_frameBuf, pCompressed, pCompressedEnd))
+                        return -1;
+                }
+
                 opus_encoder_ctl(enc, OPUS_RESET_STATE);
                 m_encodeSeq = 0;
                 CHK_BUF_WRITE(pCompressed, pCompressedEnd, uint16_t, 0xFFFF);
@@ -115,6 +163,8 @@ namespace SteamOpus {
         }
 
         virtual int	Decompress(const char* pCompressed, int compressedBytes, char* pUncompressed, int maxUncompressedBytes) {
+            if (!dec && !CreateDecoder()) return -1;
+
             const char* const pUncompressedOrig = pUncompressed;
             const char* const pEnd = pCompressed + compressedBytes;
             const char* const pUncompressedEnd = pUncompressed + maxUncompressedBytes;
@@ -166,15 +216,91 @@ namespace SteamOpus {
         }
 
         virtual ~Opus_FrameDecoder() {
-            opus_decoder_destroy(dec);
-            opus_encoder_destroy(enc);
+            ReleaseState();
         }
 
     private:
+        static size_t AlignState(size_t size) {
+            return (size + 63) & ~(size_t)63;
+        }
+
+        bool CreateDecoder() {
+            int error = 0;
+            if (m_state) {
+                dec = (OpusDecoder*)m_state;
+                if (opus_decoder_init(dec, SAMPLERATE_GMOD_OPUS, 1) != OPUS_OK)
+                    dec = nullptr;
+            } else {
+                dec = opus_decoder_create(SAMPLERATE_GMOD_OPUS, 1, &error);
+            }
+
+            m_hasDecoder.store(dec != nullptr, std::memory_order_relaxed);
+            return dec != nullptr;
+        }
+
+        bool CreateEncoder() {
+            int error = 0;
+            if (m_state) {
+                enc = (OpusEncoder*)(m_state + AlignState(opus_decoder_get_size(1)));
+                if (opus_encoder_init(enc, SAMPLERATE_GMOD_OPUS, 1, OPUS_APPLICATION_VOIP) != OPUS_OK)
+                    enc = nullptr;
+            } else {
+                enc = opus_encoder_create(SAMPLERATE_GMOD_OPUS, 1, OPUS_APPLICATION_VOIP, &error);
+            }
+
+            m_hasEncoder.store(enc != nullptr, std::memory_order_relaxed);
+            if (!enc)
+                return false;
+
+            opus_encoder_ctl(enc, OPUS_GET_COMPLEXITY(&m_defaultComplexity));
+            m_settingsChanged.store(false, std::memory_order_relaxed);
+            ApplyEncoderSettings();
+            return true;
+        }
+
+        void ApplyEncoderSettings() {
+            int complexity = m_complexity.load(std::memory_order_relaxed);
+            int bitrate = m_bitrate.load(std::memory_order_relaxed);
+            int vbr = m_vbr.load(std::memory_order_relaxed);
+
+            opus_encoder_ctl(enc, OPUS_SET_COMPLEXITY(complexity >= 0 ? complexity : m_defaultComplexity));
+            opus_encoder_ctl(enc, OPUS_SET_BITRATE(bitrate > 0 ? bitrate : OPUS_AUTO));
+            opus_encoder_ctl(enc, OPUS_SET_VBR(vbr >= 0 ? vbr : 1));
+        }
+
+        // Writes one [len][seq][opus data] chunk for a full frame and advances out past it
+        bool EncodeFrame(const opus_int16* chunk, char*& out, char* outEnd) {
+            if (out + sizeof(uint16_t) * 2 > outEnd)
+                return false;
+
+            uint16_t* chunk_len = (uint16_t*)out;
+            *(uint16_t*)(out + sizeof(uint16_t)) = m_encodeSeq++;
+            out += sizeof(uint16_t) * 2;
+
+            int bytes_written = opus_encode(enc, chunk, FRAME_SIZE_GMOD, (unsigned char*)out, std::min<uint64_t>(0x7FFF, outEnd - out));
+            if (bytes_written < 0)
+                return false;
+
+            *chunk_len = bytes_written;
+            out += bytes_written;
+            return true;
+        }
+
         uint16_t m_seq = 0;
         uint16_t m_encodeSeq = 0;
         OpusDecoder* dec = nullptr;
         OpusEncoder* enc = nullptr;
-        std::deque<uint16_t> sample_buf;
+        char* m_state = nullptr;
+        std::atomic<bool> m_hasDecoder{false};
+        std::atomic<bool> m_hasEncoder{false};
+
+        std::atomic<int> m_complexity{-1};
+        std::atomic<int> m_bitrate{-1};
+        std::atomic<int> m_vbr{-1};
+        std::atomic<bool> m_settingsChanged{false};
+        int m_defaultComplexity = 10;
+        // Samples that didn't make up a whole frame yet, encoded once the next call completes it
+        opus_int16 m_frameBuf[FRAME_SIZE_GMOD];
+        int m_frameFill = 0;
     };
 }
@@ -0,0 +1,137 @@
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "shm_relay.h"
+
+//Decoded voice of one player for local consumers (speech recognition, analysis), see eightbit.EnablePcmTap.
+//
+//Each tapped player gets their own shared memory ring (shm_ring.h), so a consumer can map only the players it cares
+//about. Every record is one decoded voice packet, read in place:
+//
+//	PcmTapRecord (24 bytes)
+//		uint64 timestampNs    monotonic time the packet was decoded
+//		uint64 steamid        the speaker's real steamid64
+//		uint32 sampleRate     24000, or 16000 when decimated
+//		uint32 sampleCount    int16 mono samples that follow
+//	samples
+//
+//Samples are the player's voice as it arrived, before any effects. Consumers find the end of a talk spurt by the gap
+//in timestamps.
+struct PcmTapRecord {
+	uint64_t timestampNs;
+	uint64_t steamid;
+	uint32_t sampleRate;
+	uint32_t sampleCount;
+};
+
+//Taps per phase of the 24 kHz -> 16 kHz polyphase filter.
+#define PCM_TAP_FIR_TAPS 16
+//Longest decoded packet written as one record, anything past it is cut off.
+#define PCM_TAP_MAX_SAMPLES 4800
+
+//Written from whichever thread decodes the player's packets: the game thread, or the worker the player is pinned to in
+//async mode. Never both at once.
+class PcmTap {
+public:
+	PcmTap(uint64_t steamid, bool decimate) : m_steamid(steamid), m_decimate(decimate) {
+		if (!decimate)
+			return;
+
+		//Windowed sinc low pass at 7.6 kHz, designed at 48 kHz: 24 kHz upsampled by 2, then every third sample kept.
+		const int length = PCM_TAP_FIR_TAPS * 2;
+		const double cutoff = 7600.0 / 48000.0;
+		const double pi = 3.14159265358979323846;
+		for (int k = 0; k < length; k++) {
+			double x = k - (length - 1) / 2.0;
+			double sinc = 2 * cutoff * (x == 0 ? 1.0 : std::sin(2 * pi * cutoff * x) / (2 * pi * cutoff * x));
+			double window = 0.42 - 0.5 * std::cos(2 * pi * k / (length - 1)) + 0.08 * std::cos(4 * pi * k / (length - 1));
+			//x2 makes up for the zeros upsampling puts between samples.
+			m_fir[k & 1][k >> 1] = (float)(2 * sinc * window);
+		}
+	}
+
+	//Creates /dev/shm/<name>. Linux only.
+	bool Create(const char* name, uint64_t capacity) {
+		return m_ring.Create(name, capacity);
+	}
+
+	void Write(const int16_t* samples, int count) {
+		if (count > PCM_TAP_MAX_SAMPLES)
+			count = PCM_TAP_MAX_SAMPLES;
+
+		int maxOut = m_decimate ? count * 2 / 3 + 2 : count;
+		char* buf = m_ring.BeginPacket((uint32_t)(sizeof(PcmTapRecord) + maxOut * sizeof(int16_t)));
+		if (buf == nullptr)
+			return;
+
+		PcmTapRecord* rec = (PcmTapRecord*)buf;
+		int16_t* out = (int16_t*)(rec + 1);
+		int written;
+
+		if (m_decimate) {
+			written = Decimate(samples, count, out);
+		}
+		else {
+			std::memcpy(out, samples, count * sizeof(int16_t));
+			written = count;
+		}
+
+		rec->timestampNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		rec->steamid = m_steamid;
+		rec->sampleRate = m_decimate ? 16000 : 24000;
+		rec->sampleCount = (uint32_t)written;
+
+		m_ring.CommitPacket((uint32_t)(sizeof(PcmTapRecord) + written * sizeof(int16_t)));
+		m_ring.Flush();
+	}
+
+	uint64_t GetSteamID() const {
+		return m_steamid;
+	}
+
+	uint64_t GetWrittenCount() const {
+		return m_ring.GetWrittenCount();
+	}
+
+	uint64_t GetDroppedCount() const {
+		return m_ring.GetDroppedCount();
+	}
+
+private:
+	//Positions are in half input samples (48 kHz) relative to the first sample of the current packet, outputs are 3
+	//apart. Odd positions fall between two input samples and use the other phase of the filter.
+	int Decimate(const int16_t* in, int count, int16_t* out) {
+		std::memcpy(m_work, m_history, sizeof(m_history));
+		std::memcpy(m_work + PCM_TAP_FIR_TAPS - 1, in, count * sizeof(int16_t));
+		const int16_t* x = m_work + PCM_TAP_FIR_TAPS - 1;
+
+		int written = 0;
+		int pos = m_nextPos;
+		for (; (pos >> 1) < count; pos += 3) {
+			const float* h = m_fir[pos & 1];
+			const int16_t* newest = x + (pos >> 1);
+
+			float acc = 0;
+			for (int j = 0; j < PCM_TAP_FIR_TAPS; j++)
+				acc += h[j] * newest[-j];
+
+			int v = (int)std::lrint(acc);
+			out[written++] = (int16_t)(v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v));
+		}
+		m_nextPos = pos - count * 2;
+
+		std::memcpy(m_history, x + count - (PCM_TAP_FIR_TAPS - 1), sizeof(m_history));
+		return written;
+	}
+
+	ShmRelay m_ring;
+	uint64_t m_steamid;
+	bool m_decimate;
+
+	float m_fir[2][PCM_TAP_FIR_TAPS];
+	int m_nextPos = 0;
+	int16_t m_history[PCM_TAP_FIR_TAPS - 1] = {};
+	int16_t m_work[PCM_TAP_FIR_TAPS - 1 + PCM_TAP_MAX_SAMPLES];
+};
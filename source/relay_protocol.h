@@ -0,0 +1,201 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//Framed relay format, selected with eightbit.SetRelayFormat(eightbit.RELAY_FORMAT_FRAMED).
+//Self-contained so relay consumers can drop this header into their own build and use Reader as-is.
+//
+//Every field is little endian and unaligned, there's no padding anywhere.
+//
+//	DatagramHeader (12 bytes)
+//		uint32 magic          "8BRL"
+//		uint8  version
+//		uint8  packetCount
+//		uint16 reserved
+//		uint32 sequence       per relay, +1 for every datagram sent
+//	packetCount times:
+//	PacketHeader (26 bytes)
+//		uint64 timestampNs    monotonic capture time, only meaningful relative to other packets from the same server
+//		uint64 steamid        the speaker's real steamid64
+//		uint32 sequence       per speaker slot, +1 for every packet relayed from it
+//		uint16 slot           the speaker's player slot
+//		uint8  flags          FLAG_*
+//		uint8  reserved
+//		uint16 length         payload bytes that follow
+//	payload                   the Steam voice packet without its leading steamid64
+//
+//A datagram holds packets from one server frame. Prepending the steamid to a payload gives back the packet the raw
+//relay format would have sent.
+namespace RelayProtocol {
+	const uint32_t MAGIC = 0x4C524238; // "8BRL"
+	const uint8_t VERSION = 1;
+	const size_t DATAGRAM_HEADER_SIZE = 12;
+	const size_t PACKET_HEADER_SIZE = 26;
+	const int MAX_PACKETS = 255;
+
+	enum Flags {
+		//The speaker has an effect chain active. The payload is still the original, unprocessed packet.
+		FLAG_EFFECTS = 1 << 0,
+		//Every speaker mixed into one stream, see eightbit.SetRelayMixdown. steamid is 0 and slot is MIXDOWN_SLOT.
+		FLAG_MIXDOWN = 1 << 1
+	};
+
+	const uint16_t MIXDOWN_SLOT = 0xFFFF;
+
+	struct PacketInfo {
+		uint64_t timestampNs;
+		uint64_t steamid;
+		uint32_t sequence;
+		uint16_t slot;
+		uint8_t flags;
+		uint16_t length;
+	};
+
+	inline void Put16(char* p, uint16_t v) {
+		p[0] = (char)v; p[1] = (char)(v >> 8);
+	}
+
+	inline void Put32(char* p, uint32_t v) {
+		Put16(p, (uint16_t)v); Put16(p + 2, (uint16_t)(v >> 16));
+	}
+
+	inline void Put64(char* p, uint64_t v) {
+		Put32(p, (uint32_t)v); Put32(p + 4, (uint32_t)(v >> 32));
+	}
+
+	inline uint16_t Get16(const char* p) {
+		return (uint16_t)((uint8_t)p[0] | ((uint8_t)p[1] << 8));
+	}
+
+	inline uint32_t Get32(const char* p) {
+		return Get16(p) | ((uint32_t)Get16(p + 2) << 16);
+	}
+
+	inline uint64_t Get64(const char* p) {
+		return Get32(p) | ((uint64_t)Get32(p + 4) << 32);
+	}
+
+	//Builds one datagram in a caller supplied buffer.
+	class Writer {
+	public:
+		void Begin(char* buf, size_t capacity, uint32_t sequence) {
+			m_buf = buf;
+			m_capacity = capacity;
+			m_size = DATAGRAM_HEADER_SIZE;
+			m_count = 0;
+
+			Put32(m_buf, MAGIC);
+			m_buf[4] = (char)VERSION;
+			m_buf[5] = 0;
+			Put16(m_buf + 6, 0);
+			Put32(m_buf + 8, sequence);
+		}
+
+		bool IsOpen() const {
+			return m_buf != nullptr;
+		}
+
+		size_t Size() const {
+			return m_size;
+		}
+
+		int Count() const {
+			return m_count;
+		}
+
+		//Whether a packet with length payload bytes would still fit.
+		bool Fits(size_t length) const {
+			return m_count < MAX_PACKETS && m_size + PACKET_HEADER_SIZE + length <= m_capacity;
+		}
+
+		bool Append(const PacketInfo& info, const char* payload) {
+			if (!Fits(info.length))
+				return false;
+
+			char* p = m_buf + m_size;
+			Put64(p, info.timestampNs);
+			Put64(p + 8, info.steamid);
+			Put32(p + 16, info.sequence);
+			Put16(p + 20, info.slot);
+			p[22] = (char)info.flags;
+			p[23] = 0;
+			Put16(p + 24, info.length);
+			std::memcpy(p + PACKET_HEADER_SIZE, payload, info.length);
+
+			m_size += PACKET_HEADER_SIZE + info.length;
+			m_count++;
+			return true;
+		}
+
+		//Closes the datagram and returns its size.
+		size_t Finish() {
+			m_buf[5] = (char)m_count;
+			m_buf = nullptr;
+			return m_size;
+		}
+
+	private:
+		char* m_buf = nullptr;
+		size_t m_capacity = 0;
+		size_t m_size = 0;
+		int m_count = 0;
+	};
+
+	//Reference decoder. Walks the packets of one received datagram.
+	class Reader {
+	public:
+		Reader(const char* buf, size_t len) : m_buf(buf), m_len(len), m_pos(DATAGRAM_HEADER_SIZE) {}
+
+		//Checks the header and that every packet lies inside the datagram.
+		bool IsValid() const {
+			if (m_len < DATAGRAM_HEADER_SIZE || Get32(m_buf) != MAGIC || (uint8_t)m_buf[4] != VERSION)
+				return false;
+
+			size_t pos = DATAGRAM_HEADER_SIZE;
+			for (int i = 0; i < Count(); i++) {
+				if (pos + PACKET_HEADER_SIZE > m_len)
+					return false;
+
+				pos += PACKET_HEADER_SIZE + Get16(m_buf + pos + 24);
+				if (pos > m_len)
+					return false;
+			}
+
+			return true;
+		}
+
+		uint32_t Sequence() const {
+			return Get32(m_buf + 8);
+		}
+
+		int Count() const {
+			return (uint8_t)m_buf[5];
+		}
+
+		//Reads the next packet. payload points into the datagram. Only call on a datagram that passed IsValid().
+		bool Next(PacketInfo& info, const char*& payload) {
+			if (m_read == Count())
+				return false;
+
+			const char* p = m_buf + m_pos;
+			info.timestampNs = Get64(p);
+			info.steamid = Get64(p + 8);
+			info.sequence = Get32(p + 16);
+			info.slot = Get16(p + 20);
+			info.flags = (uint8_t)p[22];
+			info.length = Get16(p + 24);
+			payload = p + PACKET_HEADER_SIZE;
+
+			m_pos += PACKET_HEADER_SIZE + info.length;
+			m_read++;
+			return true;
+		}
+
+	private:
+		const char* m_buf;
+		size_t m_len;
+		size_t m_pos;
+		int m_read = 0;
+	};
+}
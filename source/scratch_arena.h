@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//One allocation carved into equally sized, cache line aligned blocks.
+//Sized once at startup so the module's scratch memory footprint is fixed and known up front.
+class ScratchArena {
+private:
+	ScratchArena(const ScratchArena&) = delete;
+	ScratchArena& operator=(const ScratchArena&) = delete;
+
+public:
+	static const size_t ALIGNMENT = 64;
+
+	ScratchArena() {}
+
+	~ScratchArena() {
+		delete[] m_alloc;
+	}
+
+	void Init(size_t blocks, size_t blockSize) {
+		delete[] m_alloc;
+
+		m_blockSize = (blockSize + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+		m_blocks = blocks;
+		m_alloc = new char[m_blocks * m_blockSize + ALIGNMENT];
+		m_base = (char*)(((uintptr_t)m_alloc + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+		std::memset(m_base, 0, m_blocks * m_blockSize);
+	}
+
+	char* GetBlock(size_t idx) {
+		if (idx >= m_blocks)
+			return nullptr;
+
+		return m_base + idx * m_blockSize;
+	}
+
+	size_t GetBlockSize() const {
+		return m_blockSize;
+	}
+
+	size_t GetTotalSize() const {
+		return m_blocks * m_blockSize;
+	}
+
+private:
+	char* m_alloc = nullptr;
+	char* m_base = nullptr;
+	size_t m_blocks = 0;
+	size_t m_blockSize = 0;
+};
@@ -0,0 +1,72 @@
+#include "shm_relay.h"
+#include <string>
+
+#ifdef __linux
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+ShmRelay::~ShmRelay() {
+	Close();
+}
+
+bool ShmRelay::Create(const char* name, uint64_t capacity) {
+	Close();
+
+#ifdef __linux
+	uint64_t cap = 4096;
+	while (cap < capacity)
+		cap <<= 1;
+
+	std::string path = std::string("/dev/shm/") + name;
+	if (!m_file.Create(path.c_str(), ShmRing::HEADER_SIZE + cap))
+		return false;
+
+	ShmRing::Init(m_file.Data(), cap);
+	m_writer = ShmRing::Writer(m_file.Data());
+	return true;
+#else
+	(void)name;
+	(void)capacity;
+	return false;
+#endif
+}
+
+void ShmRelay::Close() {
+	if (!m_file.IsOpen())
+		return;
+
+	//Anyone still waiting on the ring shouldn't sleep through it going away.
+	m_dirty = true;
+	Flush();
+	m_file.Close();
+}
+
+char* ShmRelay::BeginPacket(uint32_t maxLen) {
+	char* buf = m_writer.Begin(maxLen);
+	if (buf == nullptr)
+		m_dropped++;
+
+	return buf;
+}
+
+void ShmRelay::CommitPacket(uint32_t len) {
+	m_writer.Commit(len);
+	m_written++;
+	m_dirty = true;
+}
+
+void ShmRelay::Flush() {
+	if (!m_dirty)
+		return;
+
+	m_dirty = false;
+	if (!m_writer.NeedsWake())
+		return;
+
+	m_wakes++;
+#ifdef __linux
+	syscall(SYS_futex, (uint32_t*)m_writer.WakeWord(), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include "mapped_file.h"
+#include "shm_ring.h"
+
+//Relay transport for consumers on the same host: datagrams are written into a shared memory ring (shm_ring.h) instead
+//of going through the loopback stack. Linux only, Create fails elsewhere.
+//Game thread only.
+class ShmRelay {
+public:
+	ShmRelay() {}
+	~ShmRelay();
+
+	//Creates /dev/shm/<name> holding a ring of at least capacity bytes. Each server instance needs its own name, one
+	//consumer can map any number of them.
+	bool Create(const char* name, uint64_t capacity);
+	void Close();
+
+	bool IsOpen() const {
+		return m_file.IsOpen();
+	}
+
+	//Same contract as Net::BeginPacket/CommitPacket. Returns nullptr, dropping the packet, if the consumer is behind.
+	char* BeginPacket(uint32_t maxLen);
+	void CommitPacket(uint32_t len);
+
+	//Wakes the consumer if it's asleep. Called once per server frame.
+	void Flush();
+
+	uint64_t GetWrittenCount() const {
+		return m_written;
+	}
+
+	uint64_t GetDroppedCount() const {
+		return m_dropped;
+	}
+
+	uint64_t GetWakeCount() const {
+		return m_wakes;
+	}
+
+private:
+	MappedFile m_file;
+	ShmRing::Writer m_writer;
+	bool m_dirty = false;
+
+	uint64_t m_written = 0;
+	uint64_t m_dropped = 0;
+	uint64_t m_wakes = 0;
+};
@@ -0,0 +1,178 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+//Shared memory relay ring, see eightbit.SetRelayTransport. One producer (the server), one consumer (the relay daemon).
+//Self-contained so consumers can map the same file and use Reader as-is.
+//
+//	Header                      one page, the three hot fields on their own cache lines
+//	data[capacity]              records, capacity is a power of two
+//
+//A record is a RecordHeader followed by length bytes of payload, padded to 8 bytes, and never wraps around the end of
+//the data area: when one wouldn't fit the producer writes a padding record and starts over at offset 0.
+//Payloads are exactly what the UDP relay would have sent as one datagram.
+//
+//Positions only ever grow, offset = position & (capacity - 1). The producer never overwrites anything past readPos,
+//if the consumer falls behind new packets are dropped.
+//
+//Wakeups (Linux): the consumer sets waiting = 1, re-checks writePos and then does FUTEX_WAIT on wakeSeq. After publishing
+//records the producer, at most once per server frame, checks waiting and if set clears it, bumps wakeSeq and does a
+//FUTEX_WAKE. A consumer that keeps up never costs the producer a syscall.
+namespace ShmRing {
+	const uint32_t MAGIC = 0x52534238; // "8BSR"
+	const uint32_t VERSION = 1;
+	const uint32_t PADDING = 0xFFFFFFFF;
+	const uint64_t HEADER_SIZE = 4096;
+
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t capacity;
+		uint64_t dataOffset;
+
+		alignas(64) std::atomic<uint64_t> writePos;
+		alignas(64) std::atomic<uint64_t> readPos;
+		alignas(64) std::atomic<uint32_t> wakeSeq;
+		std::atomic<uint32_t> waiting;
+	};
+	static_assert(sizeof(Header) <= HEADER_SIZE, "shm ring header must fit its page");
+
+	struct RecordHeader {
+		//Payload bytes, or PADDING for the filler at the end of the data area.
+		uint32_t length;
+		uint32_t reserved;
+	};
+
+	inline uint64_t RecordSize(uint32_t payloadLen) {
+		return (sizeof(RecordHeader) + payloadLen + 7) & ~(uint64_t)7;
+	}
+
+	//Lays out an empty ring in a mapping of HEADER_SIZE + capacity bytes. capacity must be a power of two.
+	inline void Init(char* base, uint64_t capacity) {
+		Header* hdr = new (base) Header();
+		hdr->magic = MAGIC;
+		hdr->version = VERSION;
+		hdr->capacity = capacity;
+		hdr->dataOffset = HEADER_SIZE;
+		hdr->writePos.store(0);
+		hdr->readPos.store(0);
+		hdr->wakeSeq.store(0);
+		hdr->waiting.store(0);
+	}
+
+	//Producer side.
+	class Writer {
+	public:
+		Writer() {}
+		explicit Writer(char* base) : m_hdr((Header*)base), m_data(base + HEADER_SIZE) {}
+
+		//Reserves room for up to maxLen payload bytes. Returns nullptr if the consumer hasn't freed enough yet.
+		char* Begin(uint32_t maxLen) {
+			uint64_t cap = m_hdr->capacity;
+			uint64_t pos = m_hdr->writePos.load(std::memory_order_relaxed);
+			uint64_t offset = pos & (cap - 1);
+			uint64_t need = RecordSize(maxLen);
+			if (need > cap)
+				return nullptr;
+
+			uint64_t pad = offset + need > cap ? cap - offset : 0;
+			if (pos + pad + need - m_hdr->readPos.load(std::memory_order_acquire) > cap)
+				return nullptr;
+
+			if (pad > 0) {
+				((RecordHeader*)(m_data + offset))->length = PADDING;
+				offset = 0;
+			}
+
+			m_pending = pos + pad;
+			return m_data + offset + sizeof(RecordHeader);
+		}
+
+		//Publishes the record reserved by Begin with its final length.
+		void Commit(uint32_t len) {
+			uint64_t offset = m_pending & (m_hdr->capacity - 1);
+			((RecordHeader*)(m_data + offset))->length = len;
+			m_hdr->writePos.store(m_pending + RecordSize(len), std::memory_order_seq_cst);
+		}
+
+		//Returns true if the consumer is asleep and the caller should FUTEX_WAKE wakeSeq.
+		bool NeedsWake() {
+			if (m_hdr->waiting.load(std::memory_order_seq_cst) == 0 || m_hdr->waiting.exchange(0) == 0)
+				return false;
+
+			m_hdr->wakeSeq.fetch_add(1);
+			return true;
+		}
+
+		std::atomic<uint32_t>* WakeWord() {
+			return &m_hdr->wakeSeq;
+		}
+
+	private:
+		Header* m_hdr = nullptr;
+		char* m_data = nullptr;
+		uint64_t m_pending = 0;
+	};
+
+	//Reference consumer. Reads records in place, Release() hands the space back to the producer.
+	class Reader {
+	public:
+		Reader(char* base, uint64_t size) : m_hdr((Header*)base), m_data(base + HEADER_SIZE), m_size(size) {}
+
+		bool IsValid() const {
+			return m_size >= HEADER_SIZE && m_hdr->magic == MAGIC && m_hdr->version == VERSION &&
+				(m_hdr->capacity & (m_hdr->capacity - 1)) == 0 && HEADER_SIZE + m_hdr->capacity <= m_size;
+		}
+
+		//Points payload at the oldest unread record. Returns false if there's nothing to read.
+		bool Next(const char*& payload, uint32_t& length) {
+			uint64_t cap = m_hdr->capacity;
+			uint64_t pos = m_hdr->readPos.load(std::memory_order_relaxed);
+
+			for (;;) {
+				if (pos == m_hdr->writePos.load(std::memory_order_acquire))
+					return false;
+
+				const RecordHeader* rec = (const RecordHeader*)(m_data + (pos & (cap - 1)));
+				if (rec->length == PADDING) {
+					pos += cap - (pos & (cap - 1));
+					m_hdr->readPos.store(pos, std::memory_order_release);
+					continue;
+				}
+
+				payload = (const char*)(rec + 1);
+				length = rec->length;
+				return true;
+			}
+		}
+
+		//Frees the record returned by the last Next().
+		void Release() {
+			uint64_t pos = m_hdr->readPos.load(std::memory_order_relaxed);
+			const RecordHeader* rec = (const RecordHeader*)(m_data + (pos & (m_hdr->capacity - 1)));
+			m_hdr->readPos.store(pos + RecordSize(rec->length), std::memory_order_release);
+		}
+
+		//Before sleeping: set waiting, then check HasData() again, then FUTEX_WAIT on wakeSeq with the value read here.
+		uint32_t PrepareWait() {
+			uint32_t seq = m_hdr->wakeSeq.load(std::memory_order_seq_cst);
+			m_hdr->waiting.store(1, std::memory_order_seq_cst);
+			return seq;
+		}
+
+		bool HasData() const {
+			return m_hdr->readPos.load(std::memory_order_relaxed) != m_hdr->writePos.load(std::memory_order_seq_cst);
+		}
+
+		std::atomic<uint32_t>* WakeWord() {
+			return &m_hdr->wakeSeq;
+		}
+
+	private:
+		Header* m_hdr;
+		char* m_data;
+		uint64_t m_size;
+	};
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+//Bounded single-producer/single-consumer ring.
+//Slots are preallocated and written in place: the producer fills the slot returned by BeginPush() and publishes it
+//with CommitPush(), the consumer reads Front() and releases it with Pop(). Neither side ever blocks or allocates.
+template <typename T>
+class SpscRing {
+private:
+	SpscRing(const SpscRing&) = delete;
+	SpscRing& operator=(const SpscRing&) = delete;
+
+public:
+	//Capacity is rounded up to a power of two.
+	explicit SpscRing(size_t capacity) {
+		m_capacity = 1;
+		while (m_capacity < capacity)
+			m_capacity <<= 1;
+
+		m_mask = m_capacity - 1;
+		m_slots.reset(new T[m_capacity]);
+	}
+
+	//Producer side. Returns nullptr if the ring is full.
+	T* BeginPush() {
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) >= m_capacity)
+			return nullptr;
+
+		return &m_slots[tail & m_mask];
+	}
+
+	void CommitPush() {
+		m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	//Consumer side. Returns nullptr if the ring is empty.
+	T* Front() {
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return nullptr;
+
+		return &m_slots[head & m_mask];
+	}
+
+	void Pop() {
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool Empty() const {
+		return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+	}
+
+	size_t Size() const {
+		return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+	}
+
+	size_t Capacity() const {
+		return m_capacity;
+	}
+
+private:
+	alignas(64) std::atomic<size_t> m_head{0};
+	alignas(64) std::atomic<size_t> m_tail{0};
+	size_t m_capacity;
+	size_t m_mask;
+	std::unique_ptr<T[]> m_slots;
+};
+
+//Single-producer/single-consumer ring where the producer can make room by discarding the oldest entry.
+//The consumer claims a run of entries (CAS on the head) before reading them and marks them busy until it's done, the
+//producer steals the oldest entry with the same CAS and never writes into a busy one. Neither side ever blocks.
+template <typename T>
+class SpscDropRing {
+private:
+	SpscDropRing(const SpscDropRing&) = delete;
+	SpscDropRing& operator=(const SpscDropRing&) = delete;
+
+	static const size_t NOT_BUSY = ~(size_t)0;
+
+public:
+	//Capacity is rounded up to a power of two.
+	explicit SpscDropRing(size_t capacity) {
+		m_capacity = 1;
+		while (m_capacity < capacity)
+			m_capacity <<= 1;
+
+		m_mask = m_capacity - 1;
+		m_slots.reset(new T[m_capacity]);
+	}
+
+	//Producer side. Returns nullptr if the ring is full. With dropOldest the oldest unclaimed entry is discarded to make
+	//room instead, dropped is incremented for each one.
+	T* BeginPush(bool dropOldest, uint64_t& dropped) {
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+
+		for (;;) {
+			size_t head = m_head.load(std::memory_order_seq_cst);
+			size_t busy = m_busy.load(std::memory_order_seq_cst);
+			size_t oldest = busy < head ? busy : head;
+
+			if (tail - oldest < m_capacity)
+				return &m_slots[tail & m_mask];
+
+			//The slot we'd need is one the consumer is reading right now, stealing more wouldn't free it.
+			if (!dropOldest || oldest != head)
+				return nullptr;
+
+			if (m_head.compare_exchange_strong(head, head + 1, std::memory_order_seq_cst))
+				dropped++;
+		}
+	}
+
+	void CommitPush() {
+		m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	//Consumer side. Claims up to max of the oldest entries and points entries at them. The producer won't touch them,
+	//or drop them, until Release(). Returns how many were claimed, 0 if the ring is empty.
+	size_t Claim(size_t max, T** entries) {
+		for (;;) {
+			size_t head = m_head.load(std::memory_order_seq_cst);
+			size_t avail = m_tail.load(std::memory_order_acquire) - head;
+			size_t count = avail < max ? avail : max;
+			if (count == 0)
+				return 0;
+
+			m_busy.store(head, std::memory_order_seq_cst);
+			if (!m_head.compare_exchange_strong(head, head + count, std::memory_order_seq_cst)) {
+				//The producer dropped the oldest one first, try again.
+				m_busy.store(NOT_BUSY, std::memory_order_release);
+				continue;
+			}
+
+			for (size_t i = 0; i < count; i++) {
+				entries[i] = &m_slots[(head + i) & m_mask];
+			}
+			return count;
+		}
+	}
+
+	void Release() {
+		m_busy.store(NOT_BUSY, std::memory_order_release);
+	}
+
+	size_t Size() const {
+		return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+	}
+
+	size_t Capacity() const {
+		return m_capacity;
+	}
+
+private:
+	alignas(64) std::atomic<size_t> m_head{0};
+	alignas(64) std::atomic<size_t> m_busy{NOT_BUSY};
+	alignas(64) std::atomic<size_t> m_tail{0};
+	size_t m_capacity;
+	size_t m_mask;
+	std::unique_ptr<T[]> m_slots;
+};
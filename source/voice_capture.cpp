@@ -0,0 +1,80 @@
+#include "voice_capture.h"
+#include <chrono>
+#include <cstring>
+#include "voice_corpus.h"
+
+//Records are at least this big on average, used to size the index.
+#define CAPTURE_MIN_AVG_RECORD 64
+
+VoiceCapture::~VoiceCapture() {
+	Stop();
+}
+
+bool VoiceCapture::Start(const char* path, uint64_t maxBytes) {
+	Stop();
+
+	uint64_t indexCapacity = maxBytes / CAPTURE_MIN_AVG_RECORD;
+	if (indexCapacity == 0 || !m_file.Create(path, VoiceCorpus::DataOffset(indexCapacity) + maxBytes))
+		return false;
+
+	VoiceCorpus::InitHeader(m_file.Data(), m_file.Size(), indexCapacity);
+
+	m_written.store(0);
+	m_dropped.store(0);
+	m_running.store(true);
+	m_thread = std::thread(&VoiceCapture::WriterLoop, this);
+	return true;
+}
+
+void VoiceCapture::Stop() {
+	if (!m_running.exchange(false))
+		return;
+
+	//The writer drains whatever is still queued before it exits.
+	if (m_thread.joinable())
+		m_thread.join();
+
+	//Trim the unused tail so the file on disk is exactly header + index + records.
+	VoiceCorpus::FileHeader* hdr = (VoiceCorpus::FileHeader*)m_file.Data();
+	hdr->fileSize = hdr->dataEnd;
+	m_file.Close(hdr->fileSize);
+}
+
+void VoiceCapture::Submit(uint64_t timestampNs, uint32_t slot, uint64_t steamid, const char* data, uint32_t len) {
+	if (!m_running.load(std::memory_order_relaxed))
+		return;
+
+	Entry* entry = len <= CAPTURE_MAX_PACKET ? m_queue.BeginPush() : nullptr;
+	if (entry == nullptr) {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	entry->timestampNs = timestampNs;
+	entry->steamid = steamid;
+	entry->slot = slot;
+	entry->length = len;
+	std::memcpy(entry->data, data, len);
+	m_queue.CommitPush();
+}
+
+void VoiceCapture::WriterLoop() {
+	for (;;) {
+		bool running = m_running.load(std::memory_order_acquire);
+
+		while (Entry* entry = m_queue.Front()) {
+			if (VoiceCorpus::Append(m_file.Data(), entry->timestampNs, entry->steamid, entry->slot, entry->data, entry->length))
+				m_written.fetch_add(1, std::memory_order_relaxed);
+			else
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+
+			m_queue.Pop();
+		}
+
+		if (!running)
+			break;
+
+		//Capture isn't latency sensitive, polling keeps the game thread from ever having to signal us.
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include "mapped_file.h"
+#include "spsc_ring.h"
+
+#define CAPTURE_MAX_PACKET 2048
+#define CAPTURE_QUEUE_DEPTH 1024
+
+//Records raw voice packets into a memory mapped corpus file (see voice_corpus.h).
+//The game thread only copies packets into a ring, a writer thread appends them to the mapping.
+class VoiceCapture {
+public:
+	VoiceCapture() {}
+	~VoiceCapture();
+
+	bool Start(const char* path, uint64_t maxBytes);
+	void Stop();
+
+	bool IsRunning() const {
+		return m_running.load(std::memory_order_relaxed);
+	}
+
+	//Game thread. Never blocks, drops the packet if the writer has fallen behind or the file is full.
+	void Submit(uint64_t timestampNs, uint32_t slot, uint64_t steamid, const char* data, uint32_t len);
+
+	uint64_t GetWrittenCount() const {
+		return m_written.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetDroppedCount() const {
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Entry {
+		uint64_t timestampNs;
+		uint64_t steamid;
+		uint32_t slot;
+		uint32_t length;
+		char data[CAPTURE_MAX_PACKET];
+	};
+
+	void WriterLoop();
+
+	SpscRing<Entry> m_queue{CAPTURE_QUEUE_DEPTH};
+	MappedFile m_file;
+	std::thread m_thread;
+	std::atomic<bool> m_running{false};
+	std::atomic<uint64_t> m_written{0};
+	std::atomic<uint64_t> m_dropped{0};
+};
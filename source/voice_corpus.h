@@ -0,0 +1,142 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+//On-disk layout of a captured voice corpus.
+//The file is laid out so it can be memory mapped and used in place: a fixed header, a preallocated index of record
+//offsets, then append-only records. Everything is little endian and naturally aligned, records are padded to 8 bytes.
+//
+//	FileHeader
+//	uint64_t index[indexCapacity]   absolute file offset of each record
+//	RecordHeader + payload, ...
+//
+//Writers fill in a record and its index entry before bumping recordCount, so a reader only ever has to look at the
+//first recordCount entries.
+namespace VoiceCorpus {
+	const uint32_t MAGIC = 0x43564238; // "8BVC"
+	const uint32_t VERSION = 1;
+
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t indexOffset;
+		uint64_t indexCapacity;
+		uint64_t recordCount;
+		uint64_t dataOffset;
+		uint64_t dataEnd;
+		uint64_t fileSize;
+		uint64_t reserved;
+	};
+	static_assert(sizeof(FileHeader) == 64, "corpus header must stay 64 bytes");
+
+	struct RecordHeader {
+		//Monotonic capture time in nanoseconds, only meaningful relative to other records in the same file.
+		uint64_t timestampNs;
+		uint64_t steamid;
+		uint32_t slot;
+		uint32_t length;
+	};
+	static_assert(sizeof(RecordHeader) == 24, "corpus record header must stay 24 bytes");
+
+	inline uint64_t RecordSize(uint32_t payloadLen) {
+		return (sizeof(RecordHeader) + payloadLen + 7) & ~(uint64_t)7;
+	}
+
+	inline uint64_t DataOffset(uint64_t indexCapacity) {
+		return sizeof(FileHeader) + indexCapacity * sizeof(uint64_t);
+	}
+
+	//Read-only view over a mapped (or fully loaded) corpus file.
+	class View {
+	public:
+		View() {}
+		View(const char* base, uint64_t size) : m_base(base), m_size(size) {}
+
+		//Checks the header and that every published record lies inside the mapping.
+		bool IsValid() const {
+			if (m_base == nullptr || m_size < sizeof(FileHeader))
+				return false;
+
+			const FileHeader* hdr = Header();
+			if (hdr->magic != MAGIC || hdr->version != VERSION)
+				return false;
+
+			if (hdr->indexOffset + hdr->indexCapacity * sizeof(uint64_t) > m_size || hdr->recordCount > hdr->indexCapacity)
+				return false;
+
+			for (uint64_t i = 0; i < hdr->recordCount; i++) {
+				uint64_t off = Index()[i];
+				if (off + sizeof(RecordHeader) > m_size)
+					return false;
+
+				const RecordHeader* rec = (const RecordHeader*)(m_base + off);
+				if (off + sizeof(RecordHeader) + rec->length > m_size)
+					return false;
+			}
+
+			return true;
+		}
+
+		const FileHeader* Header() const {
+			return (const FileHeader*)m_base;
+		}
+
+		uint64_t Count() const {
+			return Header()->recordCount;
+		}
+
+		const RecordHeader* Record(uint64_t i) const {
+			return (const RecordHeader*)(m_base + Index()[i]);
+		}
+
+		const char* Payload(uint64_t i) const {
+			return (const char*)(Record(i) + 1);
+		}
+
+	private:
+		const uint64_t* Index() const {
+			return (const uint64_t*)(m_base + Header()->indexOffset);
+		}
+
+		const char* m_base = nullptr;
+		uint64_t m_size = 0;
+	};
+
+	//Lays out an empty corpus in buf, which must be at least DataOffset(indexCapacity) bytes.
+	inline void InitHeader(char* buf, uint64_t fileSize, uint64_t indexCapacity) {
+		FileHeader* hdr = (FileHeader*)buf;
+		std::memset(hdr, 0, sizeof(FileHeader));
+		hdr->magic = MAGIC;
+		hdr->version = VERSION;
+		hdr->indexOffset = sizeof(FileHeader);
+		hdr->indexCapacity = indexCapacity;
+		hdr->recordCount = 0;
+		hdr->dataOffset = DataOffset(indexCapacity);
+		hdr->dataEnd = hdr->dataOffset;
+		hdr->fileSize = fileSize;
+	}
+
+	//Appends a record to a corpus laid out by InitHeader. Returns false if the index or the data area is full.
+	inline bool Append(char* buf, uint64_t timestampNs, uint64_t steamid, uint32_t slot, const char* payload, uint32_t length) {
+		FileHeader* hdr = (FileHeader*)buf;
+		uint64_t size = RecordSize(length);
+		if (hdr->recordCount >= hdr->indexCapacity || hdr->dataEnd + size > hdr->fileSize)
+			return false;
+
+		RecordHeader* rec = (RecordHeader*)(buf + hdr->dataEnd);
+		rec->timestampNs = timestampNs;
+		rec->steamid = steamid;
+		rec->slot = slot;
+		rec->length = length;
+		std::memcpy(rec + 1, payload, length);
+
+		((uint64_t*)(buf + hdr->indexOffset))[hdr->recordCount] = hdr->dataEnd;
+		hdr->dataEnd += size;
+
+		//Publish the count last so a reader mapping the live file never sees a half written record.
+		std::atomic_thread_fence(std::memory_order_release);
+		hdr->recordCount++;
+		return true;
+	}
+}
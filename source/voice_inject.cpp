@@ -0,0 +1,170 @@
+#include "voice_inject.h"
+#include <algorithm>
+#include <chrono>
+#include "relay_protocol.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <WS2tcpip.h>
+#endif
+
+#ifdef __linux
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+VoiceInjector::VoiceInjector() {
+	for (int i = 0; i < INJECT_MAX_STREAMS; i++) {
+		m_streams[i].reset(new Stream());
+	}
+}
+
+VoiceInjector::~VoiceInjector() {
+	Stop();
+}
+
+uint64_t VoiceInjector::NowNs() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool VoiceInjector::Start(uint16_t port, const char* bindAddr, const std::vector<std::string>& peers) {
+	Stop();
+
+	in_addr bindIp;
+	if (inet_pton(AF_INET, bindAddr, &bindIp) != 1)
+		return false;
+
+	m_peers.clear();
+	for (const std::string& peer : peers) {
+		in_addr peerIp;
+		if (inet_pton(AF_INET, peer.c_str(), &peerIp) != 1)
+			return false;
+
+		m_peers.push_back(peerIp.s_addr);
+	}
+
+#ifdef _WIN32
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == INVALID_SOCKET)
+		return false;
+
+	//Lets the receiver thread notice Stop().
+	DWORD timeout = 100;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+#elif __linux
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return false;
+
+	//Lets the receiver thread notice Stop().
+	timeval timeout = {0, 100000};
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+
+	sockaddr_in addr = sockaddr_in();
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr = bindIp;
+
+	if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+#ifdef _WIN32
+		closesocket(sock);
+#elif __linux
+		close(sock);
+#endif
+		return false;
+	}
+
+	m_socket = (int)sock;
+	m_running.store(true);
+	m_thread = std::thread(&VoiceInjector::ReceiveLoop, this);
+	return true;
+}
+
+void VoiceInjector::Stop() {
+	if (!m_running.load())
+		return;
+
+	m_running.store(false);
+	if (m_thread.joinable())
+		m_thread.join();
+
+#ifdef _WIN32
+	closesocket(m_socket);
+#elif __linux
+	close(m_socket);
+#endif
+	m_socket = -1;
+}
+
+void VoiceInjector::SetStreamEnabled(int stream, bool enabled) {
+	if (stream < 0 || stream >= INJECT_MAX_STREAMS)
+		return;
+
+	Stream& s = *m_streams[stream];
+
+	//Whatever was left over from an earlier assignment shouldn't be played to the new one. The receiver may still be
+	//pushing a packet it took for the old one, the new generation tells Play to throw that away.
+	s.generation.fetch_add(1, std::memory_order_relaxed);
+	while (s.queue.Front() != nullptr)
+		s.queue.Pop();
+	s.jitter.Reset();
+
+	s.enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void VoiceInjector::ReceiveLoop() {
+	static const int MAX_DATAGRAM = 64 * 1024;
+	std::unique_ptr<char[]> buf(new char[MAX_DATAGRAM]);
+
+	while (m_running.load(std::memory_order_relaxed)) {
+		sockaddr_in from = sockaddr_in();
+		socklen_t fromLen = sizeof(from);
+		int len = (int)recvfrom(m_socket, buf.get(), MAX_DATAGRAM, 0, (sockaddr*)&from, &fromLen);
+		if (len <= 0)
+			continue;
+
+		if (!m_peers.empty() && std::find(m_peers.begin(), m_peers.end(), (uint32_t)from.sin_addr.s_addr) == m_peers.end()) {
+			m_rejected.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+
+		uint64_t arrival = NowNs();
+		RelayProtocol::Reader reader(buf.get(), (size_t)len);
+		if (!reader.IsValid())
+			continue;
+
+		RelayProtocol::PacketInfo info;
+		const char* payload;
+		while (reader.Next(info, payload)) {
+			if (info.slot >= INJECT_MAX_STREAMS || info.length > INJECT_MAX_PACKET)
+				continue;
+
+			Stream& s = *m_streams[info.slot];
+			uint32_t generation = s.generation.load(std::memory_order_relaxed);
+			if (!s.enabled.load(std::memory_order_relaxed))
+				continue;
+
+			s.received.fetch_add(1, std::memory_order_relaxed);
+
+			InjectPacket* pkt = s.queue.BeginPush();
+			if (pkt == nullptr) {
+				s.dropped.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			pkt->arrivalNs = arrival;
+			pkt->timestampNs = info.timestampNs;
+			pkt->steamid = info.steamid;
+			pkt->sequence = info.sequence;
+			pkt->length = info.length;
+			pkt->generation = generation;
+			std::memcpy(pkt->data, payload, info.length);
+			s.queue.CommitPush();
+		}
+	}
+}
@@ -0,0 +1,241 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spsc_ring.h"
+
+#define INJECT_MAX_STREAMS 16
+#define INJECT_MAX_PACKET 2048
+//Packets a stream can have in flight between the receiver thread and the game thread.
+#define INJECT_QUEUE_DEPTH 32
+//Packets a stream's jitter buffer can hold for reordering and delay.
+#define INJECT_JITTER_DEPTH 16
+//Playout delay bounds, the jitter buffer adapts between them.
+#define INJECT_MIN_DELAY_NS (20 * 1000000ull)
+#define INJECT_MAX_DELAY_NS (200 * 1000000ull)
+//A stream that's been quiet this long starts over, like a new talk spurt.
+#define INJECT_IDLE_RESET_NS (500 * 1000000ull)
+
+struct InjectPacket {
+	//Local steady_clock time the datagram arrived.
+	uint64_t arrivalNs;
+	//The sender's capture time, only compared with other packets of the same stream.
+	uint64_t timestampNs;
+	uint64_t steamid;
+	uint32_t sequence;
+	uint32_t length;
+	//The stream's assignment the packet was received under, see VoiceInjector::SetStreamEnabled.
+	uint32_t generation;
+	//Steam voice packet without its leading steamid64, like the framed relay format.
+	char data[INJECT_MAX_PACKET];
+};
+
+//Reorders a stream's packets by sequence and holds each one back until its playout time: the sender's timestamp plus
+//the smallest transit time seen this talk spurt, plus a target delay of three times the measured jitter (RFC 3550
+//interarrival jitter). Game thread only.
+class JitterBuffer {
+public:
+	JitterBuffer() {
+		Reset();
+	}
+
+	void Reset() {
+		m_active = false;
+		m_count = 0;
+		for (int i = 0; i < INJECT_JITTER_DEPTH; i++) {
+			m_free[i] = INJECT_JITTER_DEPTH - 1 - i;
+		}
+		m_freeCount = INJECT_JITTER_DEPTH;
+	}
+
+	void Insert(const InjectPacket& pkt) {
+		int64_t transit = (int64_t)(pkt.arrivalNs - pkt.timestampNs);
+
+		if (!m_active || pkt.arrivalNs - m_lastArrival > INJECT_IDLE_RESET_NS) {
+			Reset();
+			m_active = true;
+			m_minTransit = transit;
+			m_prevTransit = transit;
+			m_jitterNs = 0;
+			m_nextSeq = pkt.sequence;
+		}
+		else {
+			int64_t d = transit - m_prevTransit;
+			m_jitterNs += ((d < 0 ? -d : d) - m_jitterNs) / 16;
+			m_prevTransit = transit;
+			if (transit < m_minTransit)
+				m_minTransit = transit;
+		}
+		m_lastArrival = pkt.arrivalNs;
+
+		//Its turn has already passed.
+		if ((int32_t)(pkt.sequence - m_nextSeq) < 0) {
+			late++;
+			return;
+		}
+
+		int pos = m_count;
+		while (pos > 0 && (int32_t)(pkt.sequence - m_slots[m_order[pos - 1]].sequence) <= 0) {
+			if (m_slots[m_order[pos - 1]].sequence == pkt.sequence)
+				return;
+			pos--;
+		}
+
+		//Full: the oldest packet makes room, it would have been played already at a sane delay.
+		if (m_count == INJECT_JITTER_DEPTH) {
+			if (pos == 0) {
+				overflow++;
+				return;
+			}
+			PopFront();
+			overflow++;
+			pos--;
+		}
+
+		int slot = m_free[--m_freeCount];
+		InjectPacket& dst = m_slots[slot];
+		std::memcpy(&dst, &pkt, offsetof(InjectPacket, data) + pkt.length);
+
+		std::memmove(&m_order[pos + 1], &m_order[pos], (m_count - pos) * sizeof(int));
+		m_order[pos] = slot;
+		m_count++;
+	}
+
+	//The oldest packet if it's due at nowNs, nullptr otherwise.
+	const InjectPacket* PeekDue(uint64_t nowNs) const {
+		if (m_count == 0)
+			return nullptr;
+
+		const InjectPacket& front = m_slots[m_order[0]];
+		if ((int64_t)(nowNs - (front.timestampNs + m_minTransit + TargetDelayNs())) < 0)
+			return nullptr;
+
+		return &front;
+	}
+
+	void PopFront() {
+		m_nextSeq = m_slots[m_order[0]].sequence + 1;
+		m_free[m_freeCount++] = m_order[0];
+		m_count--;
+		std::memmove(&m_order[0], &m_order[1], m_count * sizeof(int));
+	}
+
+	uint64_t TargetDelayNs() const {
+		uint64_t delay = (uint64_t)m_jitterNs * 3;
+		if (delay < INJECT_MIN_DELAY_NS)
+			return INJECT_MIN_DELAY_NS;
+		if (delay > INJECT_MAX_DELAY_NS)
+			return INJECT_MAX_DELAY_NS;
+		return delay;
+	}
+
+	uint64_t late = 0;
+	uint64_t overflow = 0;
+	uint64_t played = 0;
+
+private:
+	bool m_active;
+	uint64_t m_lastArrival = 0;
+	int64_t m_minTransit = 0;
+	int64_t m_prevTransit = 0;
+	int64_t m_jitterNs = 0;
+	uint32_t m_nextSeq = 0;
+
+	InjectPacket m_slots[INJECT_JITTER_DEPTH];
+	int m_order[INJECT_JITTER_DEPTH];
+	int m_count;
+	int m_free[INJECT_JITTER_DEPTH];
+	int m_freeCount;
+};
+
+//Receives voice from external processes (bridges, music bots) in the framed relay format (relay_protocol.h) on a UDP
+//port. A packet's slot field picks the stream. A receiver thread queues packets per stream, the game thread runs them
+//through the stream's jitter buffer and plays them out at the server tick.
+//Datagrams aren't authenticated, whoever can reach the socket can speak on an assigned stream. It binds to loopback
+//unless told otherwise, and can be limited to a list of sender addresses.
+class VoiceInjector {
+public:
+	VoiceInjector();
+	~VoiceInjector();
+
+	//Binds bindAddr (an IPv4 address, 0.0.0.0 for every interface). With peers given, only datagrams from those
+	//addresses are accepted. Returns false if an address doesn't parse or the port can't be bound.
+	bool Start(uint16_t port, const char* bindAddr = "127.0.0.1", const std::vector<std::string>& peers = {});
+	void Stop();
+
+	bool IsRunning() const {
+		return m_running.load(std::memory_order_relaxed);
+	}
+
+	//Game thread. Only streams that are enabled get queued, everything else is dropped on arrival.
+	void SetStreamEnabled(int stream, bool enabled);
+
+	//Game thread. Calls fn(stream, packet) for every packet due at nowNs, oldest first per stream.
+	template <typename F>
+	void Play(uint64_t nowNs, F&& fn) {
+		for (int stream = 0; stream < INJECT_MAX_STREAMS; stream++) {
+			Stream& s = *m_streams[stream];
+			if (!s.enabled.load(std::memory_order_relaxed))
+				continue;
+
+			uint32_t generation = s.generation.load(std::memory_order_relaxed);
+			while (InjectPacket* pkt = s.queue.Front()) {
+				//Received for the stream's previous assignment, after it was drained.
+				if (pkt->generation == generation)
+					s.jitter.Insert(*pkt);
+				s.queue.Pop();
+			}
+
+			while (const InjectPacket* pkt = s.jitter.PeekDue(nowNs)) {
+				fn(stream, *pkt);
+				s.jitter.played++;
+				s.jitter.PopFront();
+			}
+		}
+	}
+
+	const JitterBuffer& GetJitter(int stream) const {
+		return m_streams[stream]->jitter;
+	}
+
+	uint64_t GetReceivedCount(int stream) const {
+		return m_streams[stream]->received.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetQueueDroppedCount(int stream) const {
+		return m_streams[stream]->dropped.load(std::memory_order_relaxed);
+	}
+
+	//Datagrams thrown away because their sender isn't one of the peers given to Start.
+	uint64_t GetRejectedCount() const {
+		return m_rejected.load(std::memory_order_relaxed);
+	}
+
+	static uint64_t NowNs();
+
+private:
+	struct Stream {
+		std::atomic<bool> enabled{false};
+		//Bumped by every SetStreamEnabled, the receiver stamps it into each packet.
+		std::atomic<uint32_t> generation{0};
+		SpscRing<InjectPacket> queue{INJECT_QUEUE_DEPTH};
+		JitterBuffer jitter;
+		std::atomic<uint64_t> received{0};
+		std::atomic<uint64_t> dropped{0};
+	};
+
+	void ReceiveLoop();
+
+	int m_socket = -1;
+	//Accepted sender addresses in network order, empty accepts everyone. Only changed while the receiver is stopped.
+	std::vector<uint32_t> m_peers;
+	std::atomic<uint64_t> m_rejected{0};
+	std::unique_ptr<Stream> m_streams[INJECT_MAX_STREAMS];
+	std::thread m_thread;
+	std::atomic<bool> m_running{false};
+};
@@ -0,0 +1,197 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "codec_pool.h"
+#include "ivoicecodec.h"
+#include "opus_framedecoder.h"
+#include "steam_voice.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIX_SSE2
+#endif
+
+//One mix block, 20 ms at the Steam voice sample rate.
+#define MIX_BLOCK_SAMPLES FRAME_SIZE_GMOD
+#define MIX_BLOCK_NS 20000000ull
+//Decoded audio buffered per speaker, anything older is dropped.
+#define MIX_FIFO_SAMPLES (SAMPLERATE_GMOD_OPUS / 2)
+//A speaker joins the mix once this many blocks are buffered, so bursty packets don't leave holes.
+#define MIX_PRIME_BLOCKS 2
+//After a stall (level change, hitch) the mix clock skips ahead rather than bursting out this many blocks.
+#define MIX_MAX_CATCHUP 5
+
+//dst += src with 16 bit saturation.
+inline void MixSaturate(int16_t* dst, const int16_t* src, int samples) {
+	int i = 0;
+#ifdef MIX_SSE2
+	for (; i + 8 <= samples; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epi16(a, b));
+	}
+#endif
+	for (; i < samples; i++) {
+		int v = dst[i] + src[i];
+		dst[i] = (int16_t)(v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v));
+	}
+}
+
+//Server side mixdown of every speaker into one voice stream.
+//Speakers' packets are decoded as they come in, every 20 ms of wall time one block is mixed from all of them and
+//encoded once. Game thread only, decoding included: the async pipeline doesn't cover it.
+//Every speaker's buffer is allocated up front. Their decoders and the mix's encoder are checked out of the module's
+//CodecPool, which has to outlive the mixer, and a speaker's goes back with ReleaseSpeakers.
+class VoiceMixer {
+public:
+	VoiceMixer(CodecPool& codecs, int players) : m_codecs(codecs), m_speakers(players) {
+		m_encoder = m_codecs.Acquire();
+	}
+
+	~VoiceMixer() {
+		for (Speaker& speaker : m_speakers) {
+			m_codecs.Release(speaker.codec);
+		}
+		m_codecs.Release(m_encoder);
+	}
+
+	//Decodes a speaker's packet into their buffer.
+	void Submit(int slot, int userid, const char* data, int nBytes, uint64_t nowNs) {
+		if (slot < 0 || slot >= (int)m_speakers.size())
+			return;
+
+		Speaker& speaker = m_speakers[slot];
+		if (speaker.codec == nullptr)
+			speaker.codec = m_codecs.Acquire();
+
+		if (speaker.userid != userid) {
+			speaker.codec->ResetState();
+			speaker.userid = userid;
+			speaker.count = 0;
+			speaker.primed = false;
+		}
+		speaker.lastVoiceNs = nowNs;
+
+		int bytes = SteamVoice::DecompressIntoBuffer(speaker.codec, data, nBytes, (char*)m_decodeBuf, sizeof(m_decodeBuf));
+		if (bytes <= 0)
+			return;
+
+		const int16_t* samples = m_decodeBuf;
+		int n = bytes / 2;
+		if (n > MIX_FIFO_SAMPLES) {
+			samples += n - MIX_FIFO_SAMPLES;
+			n = MIX_FIFO_SAMPLES;
+		}
+
+		//Full: the oldest audio goes.
+		int overflow = speaker.count + n - MIX_FIFO_SAMPLES;
+		if (overflow > 0) {
+			speaker.head = (speaker.head + overflow) % MIX_FIFO_SAMPLES;
+			speaker.count -= overflow;
+		}
+
+		int tail = (speaker.head + speaker.count) % MIX_FIFO_SAMPLES;
+		int first = n < MIX_FIFO_SAMPLES - tail ? n : MIX_FIFO_SAMPLES - tail;
+		std::memcpy(speaker.fifo + tail, samples, first * 2);
+		std::memcpy(speaker.fifo, samples + first, (n - first) * 2);
+		speaker.count += n;
+
+		if (speaker.count >= MIX_PRIME_BLOCKS * MIX_BLOCK_SAMPLES)
+			speaker.primed = true;
+	}
+
+	//Mixes and encodes every block that's due by nowNs, calls fn(packet, nBytes) for each. Packets are Steam voice
+	//packets with a steamid of 0. Silent blocks aren't sent.
+	template <typename F>
+	void Mix(uint64_t nowNs, F&& fn) {
+		if (m_nextBlockNs == 0)
+			m_nextBlockNs = nowNs;
+
+		int blocks = 0;
+		while ((int64_t)(nowNs - m_nextBlockNs) >= 0) {
+			if (++blocks > MIX_MAX_CATCHUP) {
+				m_nextBlockNs = nowNs + MIX_BLOCK_NS;
+				break;
+			}
+			m_nextBlockNs += MIX_BLOCK_NS;
+
+			if (!MixBlock())
+				continue;
+
+			int len = SteamVoice::CompressIntoBuffer(0, m_encoder, (const char*)m_mix, sizeof(m_mix), m_packet, sizeof(m_packet), SAMPLERATE_GMOD_OPUS);
+			if (len > 0)
+				fn(m_packet, len);
+		}
+	}
+
+	//Hands back the codec of every speaker release(slot, userid, lastVoiceNs) says is gone, and drops what they had
+	//buffered. They get a codec again with their next packet.
+	template <typename F>
+	void ReleaseSpeakers(F&& release) {
+		for (size_t slot = 0; slot < m_speakers.size(); slot++) {
+			Speaker& speaker = m_speakers[slot];
+			if (speaker.codec == nullptr || !release((int)slot, speaker.userid, speaker.lastVoiceNs))
+				continue;
+
+			m_codecs.Release(speaker.codec);
+			speaker.codec = nullptr;
+			speaker.userid = -1;
+			speaker.count = 0;
+			speaker.primed = false;
+		}
+	}
+
+	uint64_t GetMixedBlockCount() const {
+		return m_mixedBlocks;
+	}
+
+private:
+	struct Speaker {
+		int userid = -1;
+		IVoiceCodec* codec = nullptr;
+		uint64_t lastVoiceNs = 0;
+		bool primed = false;
+		int head = 0;
+		int count = 0;
+		int16_t fifo[MIX_FIFO_SAMPLES];
+	};
+
+	//Sums one block from every primed speaker into m_mix. Returns false if nobody was talking.
+	bool MixBlock() {
+		bool active = false;
+		std::memset(m_mix, 0, sizeof(m_mix));
+
+		for (Speaker& speaker : m_speakers) {
+			if (!speaker.primed)
+				continue;
+
+			int n = speaker.count < MIX_BLOCK_SAMPLES ? speaker.count : MIX_BLOCK_SAMPLES;
+			int first = n < MIX_FIFO_SAMPLES - speaker.head ? n : MIX_FIFO_SAMPLES - speaker.head;
+			MixSaturate(m_mix, speaker.fifo + speaker.head, first);
+			MixSaturate(m_mix + first, speaker.fifo, n - first);
+
+			speaker.head = (speaker.head + n) % MIX_FIFO_SAMPLES;
+			speaker.count -= n;
+			if (speaker.count == 0)
+				speaker.primed = false;
+
+			active = true;
+		}
+
+		if (active)
+			m_mixedBlocks++;
+
+		return active;
+	}
+
+	CodecPool& m_codecs;
+	std::vector<Speaker> m_speakers;
+	IVoiceCodec* m_encoder;
+	uint64_t m_nextBlockNs = 0;
+	uint64_t m_mixedBlocks = 0;
+
+	int16_t m_decodeBuf[MIX_FIFO_SAMPLES];
+	int16_t m_mix[MIX_BLOCK_SAMPLES];
+	char m_packet[4096];
+};
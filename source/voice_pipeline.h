@@ -0,0 +1,295 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ivoicecodec.h"
+#include "audio_effects.h"
+#include "steam_voice.h"
+#include "spsc_ring.h"
+#include "eightbit_state.h"
+#include "pcm_tap.h"
+
+#define VOICE_MAX_PACKET 2048
+#define VOICE_MAX_RECOMPRESSED 4096
+#define VOICE_QUEUE_DEPTH 8
+#define VOICE_DECOMPRESS_SCRATCH (20 * 1024)
+//Each player owns one arena block: decompression scratch followed by recompression output.
+#define VOICE_SCRATCH_BLOCK (VOICE_DECOMPRESS_SCRATCH + VOICE_MAX_RECOMPRESSED)
+
+//Decode -> effects -> encode for a single steam voice packet.
+//Outputs number of bytes written to recompressOut, or -1 if the packet should be passed through untouched.
+//Stage timings go into stats when it isn't null. The decoded samples go to tap when it isn't null, a tapped player
+//without effects is only decoded and passed through.
+inline int ProcessVoicePacket(IVoiceCodec* codec, const AudioEffects::EffectChain& chain, AudioEffects::EffectState* effectState,
+		const char* data, int nBytes, char* decompressBuf, int maxDecompressed, char* recompressOut, int maxRecompressed,
+		VoiceStats::PlayerStats* stats, PcmTap* tap) {
+	if (stats == nullptr) {
+		int bytesDecompressed = SteamVoice::DecompressIntoBuffer(codec, data, nBytes, decompressBuf, maxDecompressed);
+		int samples = bytesDecompressed / 2;
+		if (bytesDecompressed <= 0)
+			return -1;
+
+		if (tap != nullptr) {
+			tap->Write((const int16_t*)decompressBuf, samples);
+			if (chain.IsIdentity())
+				return -1;
+		}
+
+		chain.Run((uint16_t*)decompressBuf, samples, effectState);
+
+		uint64_t steamid = *(uint64_t*)data;
+		return SteamVoice::CompressIntoBuffer(steamid, codec, decompressBuf, samples * 2, recompressOut, maxRecompressed, 24000);
+	}
+
+	uint64_t t0 = VoiceStats::ReadTicks();
+	int bytesDecompressed = SteamVoice::DecompressIntoBuffer(codec, data, nBytes, decompressBuf, maxDecompressed);
+	int samples = bytesDecompressed / 2;
+	uint64_t t1 = VoiceStats::ReadTicks();
+	stats->stages[VoiceStats::STAGE_DECOMPRESS].Record(t1 - t0);
+	if (bytesDecompressed <= 0)
+		return -1;
+
+	if (tap != nullptr) {
+		tap->Write((const int16_t*)decompressBuf, samples);
+		if (chain.IsIdentity())
+			return -1;
+		t1 = VoiceStats::ReadTicks();
+	}
+
+	//Same as chain.Run, one stage at a time so each effect gets its own timing.
+	uint64_t stageStart = t1;
+	for (int i = 0; i < chain.count; i++) {
+		const AudioEffects::EffectStage& stage = chain.stages[i];
+		stage.func((uint16_t*)decompressBuf, samples, stage.params, effectState);
+
+		uint64_t now = VoiceStats::ReadTicks();
+		stats->effects[stage.id].Record(now - stageStart);
+		stageStart = now;
+	}
+	stats->stages[VoiceStats::STAGE_EFFECTS].Record(stageStart - t1);
+
+	uint64_t steamid = *(uint64_t*)data;
+	int bytesWritten = SteamVoice::CompressIntoBuffer(steamid, codec, decompressBuf, samples * 2, recompressOut, maxRecompressed, 24000);
+	stats->stages[VoiceStats::STAGE_COMPRESS].Record(VoiceStats::ReadTicks() - stageStart);
+	return bytesWritten;
+}
+
+//Asynchronous voice processing.
+//The voice hook copies packets into per-player queues and returns immediately. Each player is pinned to one worker
+//(slot % workers), so a player's codec is only ever touched by one thread and their packets complete in order.
+//Completed packets are collected on the game thread by DrainCompleted() once per frame.
+class VoicePipeline {
+public:
+	struct Job {
+		IVoiceCodec* codec;
+		AudioEffects::EffectChain chain;
+		AudioEffects::EffectState* effectState;
+		char* decompressBuf;
+		VoiceStats::PlayerStats* stats;
+		PcmTap* tap;
+		int userid;
+		int64_t xuid;
+		std::chrono::steady_clock::time_point queued;
+		int nBytes;
+		char data[VOICE_MAX_PACKET];
+	};
+
+	struct Result {
+		int userid;
+		int64_t xuid;
+		//False if the packet couldn't be processed in time and data holds the original packet.
+		bool processed;
+		int nBytes;
+		char data[VOICE_MAX_RECOMPRESSED];
+	};
+
+	VoicePipeline(int players, int workers, int maxLatencyMs) : m_maxLatency(std::chrono::milliseconds(maxLatencyMs)) {
+		if (workers < 1)
+			workers = 1;
+
+		for (int i = 0; i < players; i++) {
+			m_players.emplace_back(new PlayerQueues());
+		}
+
+		for (int i = 0; i < workers; i++) {
+			m_workers.emplace_back(new Worker());
+		}
+
+		for (int i = 0; i < workers; i++) {
+			m_workers[i]->thread = std::thread(&VoicePipeline::WorkerLoop, this, i);
+		}
+	}
+
+	~VoicePipeline() {
+		m_running.store(false);
+		for (auto& worker : m_workers) {
+			worker->wake.notify_one();
+		}
+		for (auto& worker : m_workers) {
+			if (worker->thread.joinable())
+				worker->thread.join();
+		}
+	}
+
+	//Game thread. Returns false if the packet was dropped because the player's queue is full. Handling it any other way
+	//would send it ahead of their packets still queued, and leave a gap in what their codec saw.
+	bool Submit(int slot, const PlayerVoiceState& player, const char* data, int nBytes, int64_t xuid) {
+		if (slot < 0 || slot >= (int)m_players.size() || nBytes > VOICE_MAX_PACKET) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		PlayerQueues& queues = *m_players[slot];
+		Job* job = queues.pending.BeginPush();
+		if (job == nullptr) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		job->codec = player.codec;
+		job->chain = player.chain;
+		job->effectState = player.effectState;
+		job->decompressBuf = player.decompressBuf;
+		job->stats = player.stats;
+		job->tap = player.tap;
+		job->userid = player.userid;
+		job->xuid = xuid;
+		job->queued = std::chrono::steady_clock::now();
+		job->nBytes = nBytes;
+		std::memcpy(job->data, data, nBytes);
+
+		queues.inFlight.fetch_add(1, std::memory_order_relaxed);
+		queues.pending.CommitPush();
+		m_workers[slot % m_workers.size()]->wake.notify_one();
+		return true;
+	}
+
+	//Game thread. Calls fn(slot, result) for every completed packet, in order per player.
+	template <typename F>
+	void DrainCompleted(F&& fn) {
+		for (int slot = 0; slot < (int)m_players.size(); slot++) {
+			PlayerQueues& queues = *m_players[slot];
+			while (Result* res = queues.completed.Front()) {
+				fn(slot, *res);
+				queues.completed.Pop();
+			}
+		}
+	}
+
+	//Game thread. Blocks until every packet queued for the slot has been processed, so its codec can be reset or freed.
+	//The worker stops when the slot's completed queue is full, so results are handed to fn(slot, result) while waiting,
+	//the same as DrainCompleted would.
+	template <typename F>
+	void WaitIdle(int slot, F&& fn) {
+		if (slot < 0 || slot >= (int)m_players.size())
+			return;
+
+		PlayerQueues& queues = *m_players[slot];
+		while (queues.inFlight.load(std::memory_order_acquire) != 0) {
+			if (Result* res = queues.completed.Front()) {
+				fn(slot, *res);
+				queues.completed.Pop();
+				continue;
+			}
+
+			std::this_thread::yield();
+		}
+	}
+
+	void SetMaxLatency(int maxLatencyMs) {
+		m_maxLatency.store(std::chrono::milliseconds(maxLatencyMs));
+	}
+
+	int GetWorkerCount() const {
+		return (int)m_workers.size();
+	}
+
+	uint64_t GetDroppedCount() const {
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetExpiredCount() const {
+		return m_expired.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct PlayerQueues {
+		SpscRing<Job> pending{VOICE_QUEUE_DEPTH};
+		SpscRing<Result> completed{VOICE_QUEUE_DEPTH};
+		std::atomic<int> inFlight{0};
+	};
+
+	struct Worker {
+		std::thread thread;
+		std::mutex mtx;
+		std::condition_variable wake;
+	};
+
+	void WorkerLoop(int idx) {
+		Worker& worker = *m_workers[idx];
+		const int stride = (int)m_workers.size();
+
+		while (m_running.load(std::memory_order_relaxed)) {
+			bool didWork = false;
+
+			for (int slot = idx; slot < (int)m_players.size(); slot += stride) {
+				PlayerQueues& queues = *m_players[slot];
+
+				while (Job* job = queues.pending.Front()) {
+					Result* res = queues.completed.BeginPush();
+					if (res == nullptr)
+						break; //Game thread hasn't caught up yet, leave the job queued.
+
+					ProcessJob(*job, *res);
+					queues.completed.CommitPush();
+					queues.pending.Pop();
+					queues.inFlight.fetch_sub(1, std::memory_order_release);
+					didWork = true;
+				}
+			}
+
+			if (!didWork) {
+				//Submit() doesn't take the lock, so a wakeup can be missed. The timeout bounds how long that can stall a packet.
+				std::unique_lock<std::mutex> lock(worker.mtx);
+				worker.wake.wait_for(lock, std::chrono::milliseconds(1));
+			}
+		}
+	}
+
+	void ProcessJob(const Job& job, Result& res) {
+		res.userid = job.userid;
+		res.xuid = job.xuid;
+
+		if (std::chrono::steady_clock::now() - job.queued > m_maxLatency.load(std::memory_order_relaxed)) {
+			m_expired.fetch_add(1, std::memory_order_relaxed);
+		}
+		else {
+			//The player's scratch block is only ever used by the worker the player is pinned to.
+			int bytesWritten = ProcessVoicePacket(job.codec, job.chain, job.effectState, job.data, job.nBytes,
+				job.decompressBuf, VOICE_DECOMPRESS_SCRATCH, res.data, sizeof(res.data), job.stats, job.tap);
+
+			if (bytesWritten > 0) {
+				res.processed = true;
+				res.nBytes = bytesWritten;
+				return;
+			}
+		}
+
+		res.processed = false;
+		res.nBytes = job.nBytes;
+		std::memcpy(res.data, job.data, job.nBytes);
+	}
+
+	std::vector<std::unique_ptr<PlayerQueues>> m_players;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::atomic<bool> m_running{true};
+	std::atomic<std::chrono::steady_clock::duration> m_maxLatency;
+	std::atomic<uint64_t> m_dropped{0};
+	std::atomic<uint64_t> m_expired{0};
+};
@@ -0,0 +1,178 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include "audio_effects.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace VoiceStats {
+	enum Stage {
+		STAGE_RELAY,
+		STAGE_DECOMPRESS,
+		STAGE_EFFECTS,
+		STAGE_COMPRESS,
+		STAGE_FANOUT,
+		STAGE_COUNT
+	};
+
+	static const char* const StageNames[STAGE_COUNT] = {
+		"relay",
+		"decompress",
+		"effects",
+		"compress",
+		"fanout"
+	};
+
+	//Raw timestamp for measuring short intervals. The TSC where there is one, steady_clock ns otherwise.
+	//Histograms store ticks, TickClock converts to ns only when stats are read.
+	inline uint64_t ReadTicks() {
+#if defined(_MSC_VER) || defined(__i386__) || defined(__x86_64__)
+		return __rdtsc();
+#else
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	//Calibrates ticks against steady_clock over the whole time since Start(), no blocking calibration loop needed.
+	class TickClock {
+	public:
+		void Start() {
+			m_startTicks = ReadTicks();
+			m_startTime = std::chrono::steady_clock::now();
+		}
+
+		double NsPerTick() const {
+			uint64_t ticks = ReadTicks() - m_startTicks;
+			double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_startTime).count();
+			return ticks > 0 ? ns / ticks : 1.0;
+		}
+
+	private:
+		uint64_t m_startTicks = 0;
+		std::chrono::steady_clock::time_point m_startTime;
+	};
+
+	//Log-scale histogram with 4 buckets per power of two (~19% resolution), anything past 2^40 ticks lands in the last one.
+	//Single writer: Record() is plain loads and stores, no locked instructions. Readers never write to it, windows
+	//are taken by diffing against an earlier Snapshot.
+	class LatencyHistogram {
+	public:
+		static const int SUB_BITS = 2;
+		static const int MAX_BITS = 40;
+		static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+		static int BucketFor(uint64_t v) {
+			if (v < (1u << SUB_BITS))
+				return (int)v;
+			if (v >> MAX_BITS)
+				return BUCKETS - 1;
+
+			int msb = MAX_BITS - 1;
+			while (!(v >> msb))
+				msb--;
+
+			int sub = (int)((v >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+			return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+		}
+
+		//Smallest value that lands in the bucket.
+		static uint64_t BucketLow(int bucket) {
+			if (bucket < (1 << SUB_BITS))
+				return (uint64_t)bucket;
+
+			int msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+			uint64_t sub = (uint64_t)(bucket & ((1 << SUB_BITS) - 1));
+			return ((uint64_t)1 << msb) | (sub << (msb - SUB_BITS));
+		}
+
+		void Record(uint64_t ticks) {
+			Bump(m_buckets[BucketFor(ticks)], 1);
+			Bump(m_count, 1);
+			Bump(m_sum, ticks);
+		}
+
+		//Ticks recorded since the start, for readers that only need the total.
+		uint64_t GetSum() const {
+			return m_sum.load(std::memory_order_relaxed);
+		}
+
+		struct Snapshot {
+			uint32_t buckets[BUCKETS];
+			uint64_t count;
+			uint64_t sum;
+
+			void Clear() {
+				std::memset(this, 0, sizeof(*this));
+			}
+
+			void Add(const Snapshot& other) {
+				for (int i = 0; i < BUCKETS; i++)
+					buckets[i] += other.buckets[i];
+				count += other.count;
+				sum += other.sum;
+			}
+
+			//Value at quantile q (0-1), reported as the middle of its bucket.
+			uint64_t Percentile(double q) const {
+				if (count == 0)
+					return 0;
+
+				uint64_t rank = (uint64_t)(q * (count - 1)) + 1;
+				uint64_t seen = 0;
+				for (int i = 0; i < BUCKETS; i++) {
+					seen += buckets[i];
+					if (seen >= rank) {
+						uint64_t lo = BucketLow(i);
+						uint64_t hi = i + 1 < BUCKETS ? BucketLow(i + 1) : lo;
+						return lo + (hi - lo) / 2;
+					}
+				}
+				return BucketLow(BUCKETS - 1);
+			}
+		};
+
+		//Everything recorded since prev was taken, prev is moved forward to now.
+		void TakeWindow(Snapshot& prev, Snapshot& window) const {
+			//Bucket counters are allowed to wrap, the difference is still right for any sane window.
+			for (int i = 0; i < BUCKETS; i++) {
+				uint32_t cur = m_buckets[i].load(std::memory_order_relaxed);
+				window.buckets[i] = cur - prev.buckets[i];
+				prev.buckets[i] = cur;
+			}
+
+			uint64_t count = m_count.load(std::memory_order_relaxed);
+			uint64_t sum = m_sum.load(std::memory_order_relaxed);
+			window.count = count - prev.count;
+			window.sum = sum - prev.sum;
+			prev.count = count;
+			prev.sum = sum;
+		}
+
+	private:
+		template <typename T>
+		static void Bump(std::atomic<T>& v, uint64_t by) {
+			v.store((T)(v.load(std::memory_order_relaxed) + by), std::memory_order_relaxed);
+		}
+
+		std::atomic<uint32_t> m_buckets[BUCKETS] = {};
+		std::atomic<uint64_t> m_count{0};
+		std::atomic<uint64_t> m_sum{0};
+	};
+
+	//Everything measured for one player slot. Game thread stages (relay, fanout) and worker stages (decompress, effects,
+	//compress) are separate histograms, so each histogram still only has one writer in async mode.
+	struct PlayerStats {
+		LatencyHistogram stages[STAGE_COUNT];
+		LatencyHistogram effects[AudioEffects::EFF_COUNT];
+
+		//Reader side baselines for the current window, only touched by GetStats.
+		LatencyHistogram::Snapshot stageBase[STAGE_COUNT];
+		LatencyHistogram::Snapshot effectBase[AudioEffects::EFF_COUNT];
+	};
+}